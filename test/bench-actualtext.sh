@@ -0,0 +1,26 @@
+#! /usr/bin/env bash
+# Compare XDV output throughput with \XeTeXgenerateactualtext off and on.
+# Usage: bench-actualtext.sh [xetex] [pages] [runs]
+
+_xetex=${1:-xetex}
+pages=${2:-1000}
+runs=${3:-3}
+
+srcdir=`cd \`dirname $0\` && pwd`
+tmpdir=`mktemp -d` || exit 1
+trap 'rm -rf "$tmpdir"' 0
+
+TEXINPUTS="$srcdir;"; export TEXINPUTS
+
+for at in 0 1; do
+  i=0
+  while [ $i -lt $runs ]; do
+    i=`expr $i + 1`
+    echo "ActualText $at, run $i:"
+    ( time -p $_xetex -no-pdf -interaction=batchmode -output-directory="$tmpdir" \
+        "\\def\\actualtext{$at}\\def\\pages{$pages}\\input bench-actualtext" \
+        >/dev/null ) 2>&1 | sed -n -e 's/^real/  real/p' -e 's/^user/  user/p'
+  done
+  size=`wc -c <"$tmpdir/bench-actualtext.xdv"`
+  echo "  $size bytes of XDV for $pages pages"
+done
@@ -92,6 +92,7 @@ public:
     bool getLayoutDirVertical() const { return m_vertical; };
 
     float getPointSize() const { return m_pointSize; };
+    unsigned short getUnitsPerEM() const { return m_unitsPerEM; };
     float getAscent() const { return m_ascent; }
     float getDescent() const { return m_descent; }
     float getCapHeight() const { return m_capHeight; }
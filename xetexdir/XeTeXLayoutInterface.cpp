@@ -46,10 +46,13 @@ authorization from the copyright holders.
 #endif
 #include <hb-ot.h>
 
+#include "md5.h"
+
 #include "XeTeX_web.h"
 
 #include "XeTeXLayoutInterface.h"
 #include "XeTeXFontInst.h"
+#include "XeTeXShapeCache.h"
 #ifdef XETEX_MAC
 #include "XeTeXFontInst_Mac.h"
 #elif defined (XETEX_SPEC)
@@ -73,12 +76,27 @@ struct XeTeXLayoutEngine_rec
     float           slant;
     float           embolden;
     hb_buffer_t*    hbBuffer;
+    uint16_t*       pieceText;  // word whose pieces are being measured (see layoutPiece)
+    int32_t         pieceLen;
+    hb_buffer_t*    pieceBuffer; // its shaping, made on first use
+    bool            pieceRTL;
+    char*           pieceSafe;  // pieceLen + 1 flags: may pieceBuffer be cut before this character?
+    uint32_t*       pieceGlyphs; // 2 * pieceLen: the glyphs [first, last) of pieceBuffer in the cluster at each character
+    gr_feature_val* grFeatureValues; // Graphite features for line breaking, made on first use
+    gr_segment*     grSegment;  // state of Graphite line breaking (see initGraphiteBreaking)
+    const gr_slot*  grPrevSlot;
+    uint16_t*       grText;
+    int             grTextLen;
+    int             fontDigestState; // for the shaping cache: 0 = not yet known, 1 = known, -1 = unavailable
+    unsigned char   fontDigest[SHAPING_CACHE_KEY_SIZE];
 };
 
 /*******************************************************************/
 /* Glyph bounding box cache to speed up \XeTeXuseglyphmetrics mode */
 /*******************************************************************/
 #include <map>
+#include <string>
+#include <vector>
 
 // key is combined value representing (font_id << 16) + glyph
 // value is glyph bounding box in TeX points
@@ -102,11 +120,41 @@ cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
     uint32_t key = ((uint32_t)fontID << 16) + glyphID;
     sGlyphBoxes[key] = *bbox;
 }
+
+/* contextual inter-word space widths, keyed by font and the text of the
+   clusters on either side of the space (see get_native_interword_space) */
+static std::map<std::string,Fixed> sInterwordSpaces;
+
+static std::string
+interwordSpaceKey(uint16_t fontID, const uint16_t* text, int len)
+{
+    std::string key((const char*)&fontID, sizeof(fontID));
+    key.append((const char*)text, len * sizeof(uint16_t));
+    return key;
+}
+
+int
+getCachedInterwordSpace(uint16_t fontID, const uint16_t* text, int len, Fixed* space)
+{
+    std::map<std::string,Fixed>::const_iterator i = sInterwordSpaces.find(interwordSpaceKey(fontID, text, len));
+    if (i == sInterwordSpaces.end()) {
+        return 0;
+    }
+    *space = i->second;
+    return 1;
+}
+
+void
+cacheInterwordSpace(uint16_t fontID, const uint16_t* text, int len, Fixed space)
+{
+    sInterwordSpaces[interwordSpaceKey(fontID, text, len)] = space;
+}
 /*******************************************************************/
 
 void
 terminatefontmanager()
 {
+    saveShapingCache();
     XeTeXFontMgr::Terminate();
 }
 
@@ -211,171 +259,157 @@ getSlant(XeTeXFont font)
     return D2Fix(tan(-italAngle * M_PI / 180.0));
 }
 
-static unsigned int
-getLargerScriptListTable(XeTeXFont font, hb_tag_t** scriptList)
-{
-    unsigned int rval = 0;
-
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-
-    hb_tag_t* scriptListSub = NULL;
-    hb_tag_t* scriptListPos = NULL;
+/*
+ * The OpenType script, language and feature lists of a face are gathered once
+ * and kept with the face, so that enumerating them (with \XeTeXOTscripttag
+ * and friends) doesn't re-read the tables for every item.
+ */
 
-    unsigned int scriptCountSub = hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, NULL, NULL);
-    scriptListSub = (hb_tag_t*) xcalloc(scriptCountSub, sizeof(hb_tag_t*));
-    hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, &scriptCountSub, scriptListSub);
-
-    unsigned int scriptCountPos = hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GPOS, 0, NULL, NULL);
-    scriptListPos = (hb_tag_t*) xcalloc(scriptCountPos, sizeof(hb_tag_t*));
-    hb_ot_layout_table_get_script_tags(face, HB_OT_TAG_GSUB, 0, &scriptCountPos, scriptListPos);
-
-    if (scriptCountSub > scriptCountPos) {
-        if (scriptList != NULL)
-            *scriptList = scriptListSub;
-        rval = scriptCountSub;
-    } else {
-        if (scriptList != NULL)
-            *scriptList = scriptListPos;
-        rval = scriptCountPos;
-    }
+struct OTLayoutInfo
+{
+    std::vector<hb_tag_t>                                           scripts;    // the larger of the GSUB and GPOS lists
+    std::map<hb_tag_t,std::vector<hb_tag_t> >                       languages;  // GSUB's followed by GPOS's
+    std::map<std::pair<hb_tag_t,hb_tag_t>,std::vector<hb_tag_t> >   features;   // filled in as they are asked for
+};
 
-    return rval;
-}
+static hb_user_data_key_t sLayoutInfoKey;
 
-unsigned int
-countScripts(XeTeXFont font)
+static void
+deleteLayoutInfo(void* info)
 {
-    return getLargerScriptListTable(font, NULL);
+    delete (OTLayoutInfo*)info;
 }
 
-hb_tag_t
-getIndScript(XeTeXFont font, unsigned int index)
+static std::vector<hb_tag_t>
+getScriptTags(hb_face_t* face, hb_tag_t tableTag)
 {
-    hb_tag_t rval = 0;
-
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        if (index < scriptCount)
-            rval = scriptList[index];
-    }
-
-    return rval;
+    unsigned int scriptCount = hb_ot_layout_table_get_script_tags(face, tableTag, 0, NULL, NULL);
+    std::vector<hb_tag_t> scriptList(scriptCount);
+    if (scriptCount > 0)
+        hb_ot_layout_table_get_script_tags(face, tableTag, 0, &scriptCount, &scriptList[0]);
+    scriptList.resize(scriptCount);
+    return scriptList;
 }
 
-unsigned int
-countLanguages(XeTeXFont font, hb_tag_t script)
+static void
+appendLanguageTags(hb_face_t* face, hb_tag_t tableTag, hb_tag_t script, std::vector<hb_tag_t>& langList)
 {
-    unsigned int rval = 0;
-
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        for (int i = 0; i < scriptCount; i++) {
-            if (scriptList[i] == script) {
-                rval += hb_ot_layout_script_get_language_tags (face, HB_OT_TAG_GSUB, i, 0, NULL, NULL);
-                rval += hb_ot_layout_script_get_language_tags (face, HB_OT_TAG_GPOS, i, 0, NULL, NULL);
-                break;
-            }
+    unsigned int scriptIndex;
+    if (hb_ot_layout_table_find_script(face, tableTag, script, &scriptIndex)) {
+        unsigned int langCount = hb_ot_layout_script_get_language_tags(face, tableTag, scriptIndex, 0, NULL, NULL);
+        if (langCount > 0) {
+            size_t start = langList.size();
+            langList.resize(start + langCount);
+            hb_ot_layout_script_get_language_tags(face, tableTag, scriptIndex, 0, &langCount, &langList[start]);
+            langList.resize(start + langCount);
         }
     }
-
-    return rval;
 }
 
-hb_tag_t
-getIndLanguage(XeTeXFont font, hb_tag_t script, unsigned int index)
+static OTLayoutInfo*
+getLayoutInfo(XeTeXFont font)
 {
-    hb_tag_t rval = 0;
-
     hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
-    hb_tag_t* scriptList;
-
-    unsigned int scriptCount = getLargerScriptListTable(font, &scriptList);
-    if (scriptList != NULL) {
-        for (int i = 0; i < scriptCount; i++) {
-            if (scriptList[i] == script) {
-                unsigned int langCount;
-                hb_tag_t* langList;
-
-                langCount = hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GSUB, i, 0, NULL, NULL);
-                langList = (hb_tag_t*) xcalloc(langCount, sizeof(hb_tag_t*));
-                hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GSUB, i, 0, &langCount, langList);
-
-                if (index < langCount) {
-                    rval = langList[index];
-                    break;
-                }
+    OTLayoutInfo* info = (OTLayoutInfo*) hb_face_get_user_data(face, &sLayoutInfoKey);
 
-                free(langList);
+    if (info == NULL) {
+        info = new OTLayoutInfo;
 
-                langCount = hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GPOS, i, 0, NULL, NULL);
-                langList = (hb_tag_t*) xcalloc(langCount, sizeof(hb_tag_t*));
-                hb_ot_layout_script_get_language_tags(face, HB_OT_TAG_GPOS, i, 0, &langCount, langList);
-
-                if (index < langCount) {
-                    rval = langList[index];
-                    break;
-                }
+        std::vector<hb_tag_t> scriptListSub = getScriptTags(face, HB_OT_TAG_GSUB);
+        std::vector<hb_tag_t> scriptListPos = getScriptTags(face, HB_OT_TAG_GPOS);
+        if (scriptListSub.size() > scriptListPos.size())
+            info->scripts = scriptListSub;
+        else
+            info->scripts = scriptListPos;
 
-                free(langList);
+        for (size_t i = 0; i < info->scripts.size(); i++) {
+            std::vector<hb_tag_t>& langList = info->languages[info->scripts[i]];
+            if (langList.empty()) {
+                appendLanguageTags(face, HB_OT_TAG_GSUB, info->scripts[i], langList);
+                appendLanguageTags(face, HB_OT_TAG_GPOS, info->scripts[i], langList);
             }
         }
+
+        hb_face_set_user_data(face, &sLayoutInfoKey, info, deleteLayoutInfo, true);
     }
 
-    return rval;
+    return info;
 }
 
-unsigned int
-countFeatures(XeTeXFont font, hb_tag_t script, hb_tag_t language)
+static const std::vector<hb_tag_t>&
+getFeatureTags(XeTeXFont font, hb_tag_t script, hb_tag_t language)
 {
-    unsigned int rval = 0;
+    OTLayoutInfo* info = getLayoutInfo(font);
+    std::pair<hb_tag_t,hb_tag_t> key(script, language);
+
+    std::map<std::pair<hb_tag_t,hb_tag_t>,std::vector<hb_tag_t> >::const_iterator found = info->features.find(key);
+    if (found != info->features.end())
+        return found->second;
 
     hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
+    std::vector<hb_tag_t>& featList = info->features[key];
 
     for (int i = 0; i < 2; ++i) {
         unsigned int scriptIndex, langIndex = 0;
         hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
         if (hb_ot_layout_table_find_script(face, tableTag, script, &scriptIndex)) {
             if (hb_ot_layout_script_find_language(face, tableTag, scriptIndex, language, &langIndex) || language == 0) {
-                rval += hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, NULL, NULL);
+                unsigned int featCount = hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, NULL, NULL);
+                if (featCount > 0) {
+                    size_t start = featList.size();
+                    featList.resize(start + featCount);
+                    hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, &featCount, &featList[start]);
+                    featList.resize(start + featCount);
+                }
             }
         }
     }
 
-    return rval;
+    return featList;
 }
 
-hb_tag_t
-getIndFeature(XeTeXFont font, hb_tag_t script, hb_tag_t language, unsigned int index)
+unsigned int
+countScripts(XeTeXFont font)
 {
-    hb_tag_t rval = 0;
+    return getLayoutInfo(font)->scripts.size();
+}
 
-    hb_face_t* face = hb_font_get_face(((XeTeXFontInst*)font)->getHbFont());
+hb_tag_t
+getIndScript(XeTeXFont font, unsigned int index)
+{
+    const std::vector<hb_tag_t>& scriptList = getLayoutInfo(font)->scripts;
+    return index < scriptList.size() ? scriptList[index] : 0;
+}
 
-    for (int i = 0; i < 2; ++i) {
-        unsigned int scriptIndex, langIndex = 0;
-        hb_tag_t tableTag = i == 0 ? HB_OT_TAG_GSUB : HB_OT_TAG_GPOS;
-        if (hb_ot_layout_table_find_script(face, tableTag, script, &scriptIndex)) {
-            if (hb_ot_layout_script_find_language(face, tableTag, scriptIndex, language, &langIndex) || language == 0) {
-                unsigned int featCount = hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, NULL, NULL);
-                hb_tag_t* featList = (hb_tag_t*) xcalloc(featCount, sizeof(hb_tag_t*));
-                hb_ot_layout_language_get_feature_tags(face, tableTag, scriptIndex, langIndex, 0, &featCount, featList);
+unsigned int
+countLanguages(XeTeXFont font, hb_tag_t script)
+{
+    const OTLayoutInfo* info = getLayoutInfo(font);
+    std::map<hb_tag_t,std::vector<hb_tag_t> >::const_iterator i = info->languages.find(script);
+    return i != info->languages.end() ? i->second.size() : 0;
+}
 
-                if (index < featCount) {
-                    rval = featList[index];
-                    break;
-                }
+hb_tag_t
+getIndLanguage(XeTeXFont font, hb_tag_t script, unsigned int index)
+{
+    const OTLayoutInfo* info = getLayoutInfo(font);
+    std::map<hb_tag_t,std::vector<hb_tag_t> >::const_iterator i = info->languages.find(script);
+    if (i != info->languages.end() && index < i->second.size())
+        return i->second[index];
+    return 0;
+}
 
-                index -= featCount;
-            }
-        }
-    }
+unsigned int
+countFeatures(XeTeXFont font, hb_tag_t script, hb_tag_t language)
+{
+    return getFeatureTags(font, script, language).size();
+}
 
-    return rval;
+hb_tag_t
+getIndFeature(XeTeXFont font, hb_tag_t script, hb_tag_t language, unsigned int index)
+{
+    const std::vector<hb_tag_t>& featList = getFeatureTags(font, script, language);
+    return index < featList.size() ? featList[index] : 0;
 }
 
 uint32_t
@@ -455,6 +489,7 @@ getGraphiteFeatureDefaultSetting(XeTeXLayoutEngine engine, uint32_t featureID)
         gr_feature_val *featureValues = gr_face_featureval_for_lang (grFace, tag_from_lang(engine->language));
 
         rval = gr_fref_feature_value(feature, featureValues);
+        gr_featureval_destroy(featureValues);
     }
 
     return rval;
@@ -647,6 +682,18 @@ createLayoutEngine(PlatformFontRef fontRef, XeTeXFont font, hb_tag_t script, cha
     result->slant = slant;
     result->embolden = embolden;
     result->hbBuffer = hb_buffer_create();
+    result->pieceText = NULL;
+    result->pieceLen = 0;
+    result->pieceBuffer = NULL;
+    result->pieceRTL = false;
+    result->pieceSafe = NULL;
+    result->pieceGlyphs = NULL;
+    result->grFeatureValues = NULL;
+    result->grSegment = NULL;
+    result->grPrevSlot = NULL;
+    result->grText = NULL;
+    result->grTextLen = 0;
+    result->fontDigestState = 0;
 
     // For Graphite fonts treat the language as BCP 47 tag, for OpenType we
     // treat it as a OT language tag for backward compatibility with pre-0.9999
@@ -665,6 +712,15 @@ void
 deleteLayoutEngine(XeTeXLayoutEngine engine)
 {
     hb_buffer_destroy(engine->hbBuffer);
+    hb_buffer_destroy(engine->pieceBuffer);
+    free(engine->pieceText);
+    free(engine->pieceSafe);
+    free(engine->pieceGlyphs);
+    if (engine->grSegment != NULL)
+        gr_seg_destroy(engine->grSegment);
+    if (engine->grFeatureValues != NULL)
+        gr_featureval_destroy(engine->grFeatureValues);
+    free(engine->grText);
     delete engine->font;
     free(engine->shaper);
 }
@@ -688,6 +744,57 @@ _get_unicode_funcs(void)
 }
 #endif
 
+static void
+appendToKey(md5_state_t* state, const void* data, size_t len)
+{
+    md5_append(state, (const md5_byte_t*)data, len);
+}
+
+// the shaping cache key covers the font file and everything else that can affect the result
+static bool
+getShapingCacheKey(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
+                   hb_direction_t direction, unsigned char key[SHAPING_CACHE_KEY_SIZE])
+{
+    uint32_t index;
+
+    if (engine->fontDigestState == 0) {
+        const char* pathname = engine->font->getFilename(&index);
+        if (pathname != NULL && getFontFileDigest(pathname, engine->fontDigest))
+            engine->fontDigestState = 1;
+        else
+            engine->fontDigestState = -1;
+    }
+    if (engine->fontDigestState < 0)
+        return false;
+
+    md5_state_t state;
+    md5_init(&state);
+
+    float pointSize = engine->font->getPointSize();
+    const char* language = hb_language_to_string(engine->language);
+    engine->font->getFilename(&index);
+
+    appendToKey(&state, engine->fontDigest, SHAPING_CACHE_KEY_SIZE);
+    appendToKey(&state, &index, sizeof(index));
+    appendToKey(&state, &pointSize, sizeof(pointSize));
+    appendToKey(&state, &direction, sizeof(direction));
+    appendToKey(&state, &engine->script, sizeof(engine->script));
+    if (language != NULL)
+        appendToKey(&state, language, strlen(language));
+    appendToKey(&state, "", 1);
+    appendToKey(&state, &engine->nFeatures, sizeof(engine->nFeatures));
+    appendToKey(&state, engine->features, engine->nFeatures * sizeof(hb_feature_t));
+    for (char** shaper = engine->ShaperList; *shaper != NULL; shaper++)
+        appendToKey(&state, *shaper, strlen(*shaper) + 1);
+    appendToKey(&state, &offset, sizeof(offset));
+    appendToKey(&state, &count, sizeof(count));
+    appendToKey(&state, &max, sizeof(max));
+    appendToKey(&state, chars, max * sizeof(uint16_t));
+
+    md5_finish(&state, key);
+    return true;
+}
+
 int
 layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, int32_t max,
                         bool rightToLeft)
@@ -735,6 +842,29 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
         engine->ShaperList[1] = NULL;
     }
 
+    unsigned char key[SHAPING_CACHE_KEY_SIZE];
+    bool useCache = shapingCacheEnabled() && getShapingCacheKey(engine, chars, offset, count, max, direction, key);
+    hb_buffer_t* cached = NULL;
+    if (useCache) {
+        const char* shaper;
+        if (lookupShapingCache(key, offset, offset + count, engine->hbBuffer, &shaper)) {
+            free(engine->shaper);
+            engine->shaper = strdup(shaper);
+            if (!shapingCacheVerify())
+                return hb_buffer_get_length(engine->hbBuffer);
+
+            // keep the cached result to compare with the real thing
+            cached = hb_buffer_create();
+            hb_buffer_append(cached, engine->hbBuffer, 0, hb_buffer_get_length(engine->hbBuffer));
+            hb_buffer_reset(engine->hbBuffer);
+#if !HB_VERSION_ATLEAST(2,5,0)
+            hb_buffer_set_unicode_funcs(engine->hbBuffer, hbUnicodeFuncs);
+#endif
+            hb_buffer_add_utf16(engine->hbBuffer, chars, max, offset, count);
+            hb_buffer_set_segment_properties(engine->hbBuffer, &segment_props);
+        }
+    }
+
     shape_plan = hb_shape_plan_create_cached(hbFace, &segment_props, engine->features, engine->nFeatures, engine->ShaperList);
     res = hb_shape_plan_execute(shape_plan, hbFont, engine->hbBuffer, engine->features, engine->nFeatures);
 
@@ -759,6 +889,18 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
 
     hb_shape_plan_destroy(shape_plan);
 
+    if (useCache) {
+        if (cached == NULL) {
+            storeShapingCache(key, offset, offset + count, engine->hbBuffer, engine->shaper);
+        } else {
+            if (!sameShaping(cached, engine->hbBuffer)) {
+                fprintf(stderr, "\nxetex: shaping cache entry differs from live shaping; replacing it\n");
+                storeShapingCache(key, offset, offset + count, engine->hbBuffer, engine->shaper);
+            }
+            hb_buffer_destroy(cached);
+        }
+    }
+
     int glyphCount = hb_buffer_get_length(engine->hbBuffer);
 
 #ifdef DEBUG
@@ -778,6 +920,175 @@ layoutChars(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t
     return glyphCount;
 }
 
+/*
+ * When hyphenation splits a word, its pieces can mostly be measured by slicing
+ * the shaping of the whole word rather than shaping each piece afresh. HarfBuzz
+ * marks the glyphs where the text can't be broken without changing the result;
+ * at such a boundary, only the text from the piece's edge to the nearest safe
+ * boundary inside it is re-shaped.
+ */
+
+void
+setPieceWord(XeTeXLayoutEngine engine, const uint16_t* chars, int32_t len)
+{
+    if (engine->pieceText != NULL && engine->pieceLen == len
+            && memcmp(engine->pieceText, chars, len * sizeof(uint16_t)) == 0)
+        return;
+
+    free(engine->pieceText);
+    engine->pieceText = (uint16_t*) xmalloc(len * sizeof(uint16_t));
+    memcpy(engine->pieceText, chars, len * sizeof(uint16_t));
+    engine->pieceLen = len;
+
+    hb_buffer_destroy(engine->pieceBuffer);
+    engine->pieceBuffer = NULL;
+    free(engine->pieceSafe);
+    engine->pieceSafe = NULL;
+    free(engine->pieceGlyphs);
+    engine->pieceGlyphs = NULL;
+}
+
+#if HB_VERSION_ATLEAST(1,5,0)
+// for each position 0..textLen, is it safe to break the shaped text before that character?
+// Also sets *glyphs to the range of glyphs in the cluster starting at each character, for appendCharRange.
+static char*
+findSafeBreaks(hb_buffer_t* buffer, uint32_t textLen, uint32_t** glyphs)
+{
+    unsigned int glyphCount;
+    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(buffer, &glyphCount);
+    char* safe = (char*) xcalloc(textLen + 1, 1);
+    uint32_t* range = (uint32_t*) xcalloc(2 * textLen, sizeof(uint32_t));
+
+    // a position is safe if a cluster starts there (otherwise we're inside one)...
+    for (unsigned int i = 0; i < glyphCount; i++) {
+        if (info[i].cluster < textLen) {
+            uint32_t* r = range + 2 * info[i].cluster;
+            safe[info[i].cluster] = 1;
+            if (r[0] == r[1]) {
+                r[0] = i;
+                r[1] = i + 1;
+            } else {
+                if (i < r[0])
+                    r[0] = i;
+                if (i + 1 > r[1])
+                    r[1] = i + 1;
+            }
+        }
+    }
+
+    // ...and none of its glyphs is marked unsafe
+    for (unsigned int i = 0; i < glyphCount; i++)
+        if (info[i].cluster < textLen
+                && (hb_glyph_info_get_glyph_flags(&info[i]) & HB_GLYPH_FLAG_UNSAFE_TO_BREAK))
+            safe[info[i].cluster] = 0;
+
+    safe[0] = 1;
+    safe[textLen] = 1;
+    *glyphs = range;
+    return safe;
+}
+
+// append the glyphs for characters start..end of the shaped text to out;
+// glyphs is the index made by findSafeBreaks, so only the piece's own characters are looked at
+static void
+appendCharRange(hb_buffer_t* out, hb_buffer_t* buffer, const uint32_t* glyphs, uint32_t start, uint32_t end)
+{
+    uint32_t first = hb_buffer_get_length(buffer), last = 0;
+
+    for (uint32_t c = start; c < end; c++) {
+        const uint32_t* r = glyphs + 2 * c;
+        if (r[0] < r[1]) {
+            if (r[0] < first)
+                first = r[0];
+            if (r[1] > last)
+                last = r[1];
+        }
+    }
+
+    if (first < last)
+        hb_buffer_append(out, buffer, first, last);
+}
+
+static hb_buffer_t*
+copyBuffer(hb_buffer_t* buffer)
+{
+    hb_buffer_t* copy = hb_buffer_create();
+    hb_buffer_append(copy, buffer, 0, hb_buffer_get_length(buffer));
+    return copy;
+}
+#endif
+
+int
+layoutPiece(XeTeXLayoutEngine engine, uint16_t chars[], int32_t offset, int32_t count, bool rightToLeft)
+{
+    // chars[0..count) is expected to be found at offset in the word given to setPieceWord;
+    // returns the glyph count as for layoutChars, or -1 if the caller must shape it itself
+#if HB_VERSION_ATLEAST(1,5,0)
+    if (engine->pieceText == NULL || count <= 0 || offset < 0 || offset + count > engine->pieceLen
+            || memcmp(engine->pieceText + offset, chars, count * sizeof(uint16_t)) != 0)
+        return -1;
+
+    // the flags we rely on come from the OpenType shaper
+    if (engine->shaper != NULL && strcmp(engine->shaper, "ot") != 0)
+        return -1;
+
+    if (engine->pieceBuffer == NULL || engine->pieceRTL != rightToLeft) {
+        hb_buffer_destroy(engine->pieceBuffer);
+        engine->pieceBuffer = NULL;
+        free(engine->pieceSafe);
+        engine->pieceSafe = NULL;
+        free(engine->pieceGlyphs);
+        engine->pieceGlyphs = NULL;
+        layoutChars(engine, engine->pieceText, 0, engine->pieceLen, engine->pieceLen, rightToLeft);
+        if (strcmp(engine->shaper, "ot") != 0)
+            return -1;
+        engine->pieceBuffer = copyBuffer(engine->hbBuffer);
+        engine->pieceRTL = rightToLeft;
+        engine->pieceSafe = findSafeBreaks(engine->pieceBuffer, engine->pieceLen, &engine->pieceGlyphs);
+    }
+
+    uint32_t start = offset, end = offset + count;
+    uint32_t midStart = start, midEnd = end;
+
+    while (!engine->pieceSafe[midStart])
+        ++midStart;
+    while (!engine->pieceSafe[midEnd])
+        --midEnd;
+
+    if (midStart >= midEnd)
+        return -1; // no usable part of the word's shaping; just shape the piece
+
+    // re-shape the unsafe edges of the piece, in the piece's own context
+    hb_buffer_t* head = NULL;
+    hb_buffer_t* tail = NULL;
+    if (midStart > start) {
+        layoutChars(engine, chars, 0, midStart - start, count, rightToLeft);
+        head = copyBuffer(engine->hbBuffer);
+    }
+    if (midEnd < end) {
+        layoutChars(engine, chars, midEnd - start, end - midEnd, count, rightToLeft);
+        tail = copyBuffer(engine->hbBuffer);
+    }
+
+    // assemble the glyphs in visual order
+    hb_buffer_t* first = rightToLeft ? tail : head;
+    hb_buffer_t* last = rightToLeft ? head : tail;
+    hb_buffer_reset(engine->hbBuffer);
+    if (first != NULL)
+        hb_buffer_append(engine->hbBuffer, first, 0, hb_buffer_get_length(first));
+    appendCharRange(engine->hbBuffer, engine->pieceBuffer, engine->pieceGlyphs, midStart, midEnd);
+    if (last != NULL)
+        hb_buffer_append(engine->hbBuffer, last, 0, hb_buffer_get_length(last));
+
+    hb_buffer_destroy(head);
+    hb_buffer_destroy(tail);
+
+    return hb_buffer_get_length(engine->hbBuffer);
+#else
+    return -1;
+#endif
+}
+
 void
 getGlyphs(XeTeXLayoutEngine engine, uint32_t glyphs[])
 {
@@ -835,6 +1146,195 @@ getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint positions[])
             positions[i].x = positions[i].x * engine->extend - positions[i].y * engine->slant;
 }
 
+/*
+ * getGlyphFixedPositions gives the same results as getGlyphPositions and
+ * getGlyphAdvances followed by D2Fix, but converts the whole run at once, and
+ * several glyphs at a time where the hardware allows. The float arithmetic is
+ * the same as there; the pen position, which getGlyphPositions accumulates in
+ * float, is summed in integers instead, which is identical as long as all the
+ * values stay within float's 24-bit mantissa. Otherwise we use the original.
+ */
+
+#include <float.h>
+#if defined(__SSE2__) && defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#include <emmintrin.h>
+#define SSE2_FIXED_POSITIONS    1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NEON_FIXED_POSITIONS    1
+#endif
+
+#define EXACT_FLOAT_INT_LIMIT   (1 << 24)
+
+#ifdef SSE2_FIXED_POSITIONS
+static inline __m128i
+fixedFromPoints(__m128 v)
+{
+    // D2Fix, two lanes at a time in double
+    const __m128d scale = _mm_set1_pd(65536.0);
+    const __m128d half = _mm_set1_pd(0.5);
+    __m128i lo = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(v), scale), half));
+    __m128i hi = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), scale), half));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+#endif
+
+#ifdef NEON_FIXED_POSITIONS
+static inline int32x4_t
+fixedFromPoints(float32x4_t v)
+{
+    const float64x2_t half = vdupq_n_f64(0.5);
+    float64x2_t lo = vaddq_f64(vmulq_n_f64(vcvt_f64_f32(vget_low_f32(v)), 65536.0), half);
+    float64x2_t hi = vaddq_f64(vmulq_n_f64(vcvt_high_f64_f32(v), 65536.0), half);
+    return vcombine_s32(vmovn_s64(vcvtq_s64_f64(lo)), vmovn_s64(vcvtq_s64_f64(hi)));
+}
+#endif
+
+// locations from positions in font units, as getGlyphPositions and D2Fix would give
+static void
+unitsToFixedPoints(XeTeXLayoutEngine engine, const int32_t* ux, const int32_t* uy, int n, FixedPoint* out)
+{
+    float pointSize = engine->font->getPointSize();
+    float unitsPerEM = engine->font->getUnitsPerEM();
+    bool transform = (engine->extend != 1.0 || engine->slant != 0.0);
+    int i = 0;
+
+#ifdef SSE2_FIXED_POSITIONS
+    const __m128 ps = _mm_set1_ps(pointSize);
+    const __m128 em = _mm_set1_ps(unitsPerEM);
+    const __m128 extend = _mm_set1_ps(engine->extend);
+    const __m128 slant = _mm_set1_ps(engine->slant);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(ux + i))), ps), em);
+        __m128 y = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(uy + i))), ps), em);
+        if (transform)
+            x = _mm_sub_ps(_mm_mul_ps(x, extend), _mm_mul_ps(y, slant));
+        __m128i fx = fixedFromPoints(x);
+        __m128i fy = fixedFromPoints(y);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi32(fx, fy));
+        _mm_storeu_si128((__m128i*)(out + i + 2), _mm_unpackhi_epi32(fx, fy));
+    }
+#endif
+#ifdef NEON_FIXED_POSITIONS
+    // the compiler may fuse the extend/slant multiply-subtract, so that is left to the scalar loop
+    if (!transform) {
+        const float32x4_t ps = vdupq_n_f32(pointSize);
+        const float32x4_t em = vdupq_n_f32(unitsPerEM);
+        for (; i + 4 <= n; i += 4) {
+            float32x4_t x = vdivq_f32(vmulq_f32(vcvtq_f32_s32(vld1q_s32(ux + i)), ps), em);
+            float32x4_t y = vdivq_f32(vmulq_f32(vcvtq_f32_s32(vld1q_s32(uy + i)), ps), em);
+            int32x4x2_t xy;
+            xy.val[0] = fixedFromPoints(x);
+            xy.val[1] = fixedFromPoints(y);
+            vst2q_s32((int32_t*)(out + i), xy);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        float x = engine->font->unitsToPoints(ux[i]);
+        float y = engine->font->unitsToPoints(uy[i]);
+        if (transform)
+            x = x * engine->extend - y * engine->slant;
+        out[i].x = D2Fix(x);
+        out[i].y = D2Fix(y);
+    }
+}
+
+// advances from font units, as getGlyphAdvances and D2Fix would give
+static void
+unitsToFixed(XeTeXLayoutEngine engine, const int32_t* u, int n, Fixed* out)
+{
+    float pointSize = engine->font->getPointSize();
+    float unitsPerEM = engine->font->getUnitsPerEM();
+    int i = 0;
+
+#ifdef SSE2_FIXED_POSITIONS
+    const __m128 ps = _mm_set1_ps(pointSize);
+    const __m128 em = _mm_set1_ps(unitsPerEM);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(u + i))), ps), em);
+        _mm_storeu_si128((__m128i*)(out + i), fixedFromPoints(v));
+    }
+#endif
+#ifdef NEON_FIXED_POSITIONS
+    const float32x4_t ps = vdupq_n_f32(pointSize);
+    const float32x4_t em = vdupq_n_f32(unitsPerEM);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vdivq_f32(vmulq_f32(vcvtq_f32_s32(vld1q_s32(u + i)), ps), em);
+        vst1q_s32(out + i, fixedFromPoints(v));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = D2Fix(engine->font->unitsToPoints(u[i]));
+}
+
+void
+getGlyphFixedPositions(XeTeXLayoutEngine engine, FixedPoint locations[], Fixed advances[], Fixed* width)
+{
+    int glyphCount = hb_buffer_get_length(engine->hbBuffer);
+    hb_glyph_position_t *hbPositions = hb_buffer_get_glyph_positions(engine->hbBuffer, NULL);
+    bool vertical = engine->font->getLayoutDirVertical();
+
+    // glyph positions and advances in font units, with the signs getGlyphPositions gives them
+    int32_t* ux = (int32_t*) xmalloc(3 * (glyphCount + 1) * sizeof(int32_t));
+    int32_t* uy = ux + glyphCount + 1;
+    int32_t* ua = uy + glyphCount + 1;
+
+    int64_t x = 0, y = 0;
+    int64_t maxAbs = 0;
+#define NOTE_MAGNITUDE(v) do { int64_t a = (v) < 0 ? -(v) : (v); if (a > maxAbs) maxAbs = a; } while (0)
+    for (int i = 0; i < glyphCount; i++) {
+        if (vertical) {
+            ux[i] = -(x + hbPositions[i].y_offset);
+            uy[i] = y - hbPositions[i].x_offset;
+            ua[i] = hbPositions[i].y_advance;
+            x += hbPositions[i].y_advance;
+            y += hbPositions[i].x_advance;
+        } else {
+            ux[i] = x + hbPositions[i].x_offset;
+            uy[i] = -(y + hbPositions[i].y_offset);
+            ua[i] = hbPositions[i].x_advance;
+            x += hbPositions[i].x_advance;
+            y += hbPositions[i].y_advance;
+        }
+        NOTE_MAGNITUDE(hbPositions[i].x_offset);
+        NOTE_MAGNITUDE(hbPositions[i].y_offset);
+        NOTE_MAGNITUDE(hbPositions[i].x_advance);
+        NOTE_MAGNITUDE(hbPositions[i].y_advance);
+        NOTE_MAGNITUDE(ux[i]);
+        NOTE_MAGNITUDE(uy[i]);
+        NOTE_MAGNITUDE(x);
+        NOTE_MAGNITUDE(y);
+    }
+#undef NOTE_MAGNITUDE
+    ux[glyphCount] = vertical ? -x : x;
+    uy[glyphCount] = vertical ? y : -y;
+
+    if (maxAbs <= EXACT_FLOAT_INT_LIMIT) {
+        FixedPoint end;
+        unitsToFixedPoints(engine, ux, uy, glyphCount, locations);
+        unitsToFixedPoints(engine, ux + glyphCount, uy + glyphCount, 1, &end);
+        unitsToFixed(engine, ua, glyphCount, advances);
+        *width = end.x;
+    } else {
+        // too big to sum exactly in float, so do exactly what getGlyphPositions does
+        FloatPoint* positions = (FloatPoint*) xcalloc(glyphCount + 1, sizeof(FloatPoint));
+        float* floatAdvances = (float*) xcalloc(glyphCount, sizeof(float));
+        getGlyphPositions(engine, positions);
+        getGlyphAdvances(engine, floatAdvances);
+        for (int i = 0; i < glyphCount; i++) {
+            locations[i].x = D2Fix(positions[i].x);
+            locations[i].y = D2Fix(positions[i].y);
+            advances[i] = D2Fix(floatAdvances[i]);
+        }
+        *width = D2Fix(positions[glyphCount].x);
+        free(positions);
+        free(floatAdvances);
+    }
+
+    free(ux);
+}
+
 float
 getPointSize(XeTeXLayoutEngine engine)
 {
@@ -936,10 +1436,6 @@ mapGlyphToIndex(XeTeXLayoutEngine engine, const char* glyphName)
     return engine->font->mapGlyphToIndex(glyphName);
 }
 
-static gr_segment* grSegment = NULL;
-static const gr_slot* grPrevSlot = NULL;
-static int grTextLen;
-
 bool
 initGraphiteBreaking(XeTeXLayoutEngine engine, const uint16_t* txtPtr, int txtLen)
 {
@@ -947,26 +1443,40 @@ initGraphiteBreaking(XeTeXLayoutEngine engine, const uint16_t* txtPtr, int txtLe
     gr_face* grFace = hb_graphite2_face_get_gr_face(hbFace);
     gr_font* grFont = hb_graphite2_font_get_gr_font(engine->font->getHbFont());
     if (grFace != NULL && grFont != NULL) {
-        if (grSegment != NULL) {
-            gr_seg_destroy(grSegment);
-            grSegment = NULL;
-            grPrevSlot = NULL;
+        // breaking the same text again (e.g. the same word re-measured) can reuse its segment
+        if (engine->grSegment != NULL && engine->grTextLen == txtLen
+                && memcmp(engine->grText, txtPtr, txtLen * sizeof(uint16_t)) == 0) {
+            engine->grPrevSlot = gr_seg_first_slot(engine->grSegment);
+            return true;
         }
 
-        gr_feature_val *grFeatureValues = gr_face_featureval_for_lang (grFace, tag_from_lang(engine->language));
+        if (engine->grSegment != NULL) {
+            gr_seg_destroy(engine->grSegment);
+            engine->grSegment = NULL;
+            engine->grPrevSlot = NULL;
+        }
 
-        int nFeatures = engine->nFeatures;
-        hb_feature_t *features =  engine->features;
-        while (nFeatures--) {
-            const gr_feature_ref *fref = gr_face_find_fref (grFace, features->tag);
-            if (fref)
-                gr_fref_set_feature_value (fref, features->value, grFeatureValues);
-            features++;
+        // the feature values depend only on the engine, so they are set up once
+        if (engine->grFeatureValues == NULL) {
+            engine->grFeatureValues = gr_face_featureval_for_lang (grFace, tag_from_lang(engine->language));
+
+            int nFeatures = engine->nFeatures;
+            hb_feature_t *features =  engine->features;
+            while (nFeatures--) {
+                const gr_feature_ref *fref = gr_face_find_fref (grFace, features->tag);
+                if (fref)
+                    gr_fref_set_feature_value (fref, features->value, engine->grFeatureValues);
+                features++;
+            }
         }
 
-        grSegment = gr_make_seg(grFont, grFace, engine->script, grFeatureValues, gr_utf16, txtPtr, txtLen, 0);
-        grPrevSlot = gr_seg_first_slot(grSegment);
-        grTextLen = txtLen;
+        engine->grSegment = gr_make_seg(grFont, grFace, engine->script, engine->grFeatureValues, gr_utf16, txtPtr, txtLen, 0);
+        engine->grPrevSlot = engine->grSegment != NULL ? gr_seg_first_slot(engine->grSegment) : NULL;
+
+        free(engine->grText);
+        engine->grText = (uint16_t*) xmalloc(txtLen * sizeof(uint16_t));
+        memcpy(engine->grText, txtPtr, txtLen * sizeof(uint16_t));
+        engine->grTextLen = txtLen;
 
         return true;
     }
@@ -975,23 +1485,24 @@ initGraphiteBreaking(XeTeXLayoutEngine engine, const uint16_t* txtPtr, int txtLe
 }
 
 int
-findNextGraphiteBreak(void)
+findNextGraphiteBreak(XeTeXLayoutEngine engine)
 {
     int ret = -1;
+    gr_segment* grSegment = engine->grSegment;
 
     if (grSegment != NULL) {
-        if (grPrevSlot && grPrevSlot != gr_seg_last_slot(grSegment)) {
-            for (const gr_slot* s = gr_slot_next_in_segment(grPrevSlot); s != NULL; s = gr_slot_next_in_segment(s)) {
+        if (engine->grPrevSlot && engine->grPrevSlot != gr_seg_last_slot(grSegment)) {
+            for (const gr_slot* s = gr_slot_next_in_segment(engine->grPrevSlot); s != NULL; s = gr_slot_next_in_segment(s)) {
                 const gr_char_info* ci = NULL;
                 int bw;
 
                 ci = gr_seg_cinfo(grSegment, gr_slot_index(s));
                 bw = gr_cinfo_break_weight(ci);
                 if (bw < gr_breakNone && bw >= gr_breakBeforeWord) {
-                    grPrevSlot = s;
+                    engine->grPrevSlot = s;
                     ret = gr_cinfo_base(ci);
                 } else if (bw > gr_breakNone && bw <= gr_breakWord) {
-                    grPrevSlot = gr_slot_next_in_segment(s);
+                    engine->grPrevSlot = gr_slot_next_in_segment(s);
                     ret = gr_cinfo_base(ci) + 1;
                 }
 
@@ -1000,8 +1511,8 @@ findNextGraphiteBreak(void)
             }
 
             if (ret == -1) {
-                grPrevSlot = gr_seg_last_slot(grSegment);
-                ret = grTextLen;
+                engine->grPrevSlot = gr_seg_last_slot(grSegment);
+                ret = engine->grTextLen;
             }
         }
     }
@@ -62,6 +62,9 @@ extern char gPrefEngine;
 int getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox);
 void cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox);
 
+int getCachedInterwordSpace(uint16_t fontID, const uint16_t* text, int len, Fixed* space);
+void cacheInterwordSpace(uint16_t fontID, const uint16_t* text, int len, Fixed space);
+
 void terminatefontmanager();
 
 XeTeXFont createFont(PlatformFontRef fontRef, Fixed pointSize);
@@ -112,9 +115,13 @@ float getEmboldenFactor(XeTeXLayoutEngine engine);
 int layoutChars(XeTeXLayoutEngine engine, uint16_t* chars, int32_t offset, int32_t count, int32_t max,
                         bool rightToLeft);
 
+void setPieceWord(XeTeXLayoutEngine engine, const uint16_t* chars, int32_t len);
+int layoutPiece(XeTeXLayoutEngine engine, uint16_t* chars, int32_t offset, int32_t count, bool rightToLeft);
+
 void getGlyphs(XeTeXLayoutEngine engine, uint32_t* glyphs);
 void getGlyphAdvances(XeTeXLayoutEngine engine, float *advances);
 void getGlyphPositions(XeTeXLayoutEngine engine, FloatPoint* positions);
+void getGlyphFixedPositions(XeTeXLayoutEngine engine, FixedPoint* locations, Fixed* advances, Fixed* width);
 
 float getPointSize(XeTeXLayoutEngine engine);
 
@@ -145,7 +152,7 @@ int getFontCharRange(XeTeXLayoutEngine engine, int reqFirst);
 
 /* graphite interface functions... */
 bool initGraphiteBreaking(XeTeXLayoutEngine engine, const uint16_t* txtPtr, int txtLen);
-int findNextGraphiteBreak(void);
+int findNextGraphiteBreak(XeTeXLayoutEngine engine);
 
 bool usingOpenType(XeTeXLayoutEngine engine);
 bool usingGraphite(XeTeXLayoutEngine engine);
@@ -0,0 +1,402 @@
+/****************************************************************************\
+ Part of the XeTeX typesetting system
+ Copyright (c) 2024 by the XeTeX Project
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE
+FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of the copyright holders
+shall not be used in advertising or otherwise to promote the sale,
+use or other dealings in this Software without prior written
+authorization from the copyright holders.
+\****************************************************************************/
+
+#include <w2c/config.h>
+#include <kpathsea/kpathsea.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "md5.h"
+
+#include "XeTeX_ext.h"
+#include "XeTeXShapeCache.h"
+
+#define SHAPING_CACHE_MAGIC     "XeTeXshc"
+#define SHAPING_CACHE_VERSION   2
+#define SHAPING_CACHE_MAX_SIZE  (64 * 1024 * 1024) /* we won't write a bigger cache file than this */
+#define SHAPER_NAME_SIZE        12
+
+#if HB_VERSION_ATLEAST(1,5,0)
+#define GLYPH_FLAGS             HB_GLYPH_FLAG_DEFINED   /* the bits of hb_glyph_info_t.mask we keep */
+#else
+#define GLYPH_FLAGS             0
+#endif
+
+/* the file is a header followed by records, each made of a CacheRecord and its glyphs;
+   it is written in native byte order, and the version check rejects a foreign one */
+struct CacheHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    count;
+};
+
+struct CacheRecord
+{
+    unsigned char   key[SHAPING_CACHE_KEY_SIZE];
+    uint32_t        start;      // the glyph clusters lie in start..end-1
+    uint32_t        end;
+    uint32_t        glyphCount;
+    char            shaper[SHAPER_NAME_SIZE];
+};
+
+struct CacheGlyph
+{
+    uint32_t    codepoint;
+    uint32_t    cluster;
+    uint32_t    flags;
+    int32_t     xAdvance;
+    int32_t     yAdvance;
+    int32_t     xOffset;
+    int32_t     yOffset;
+};
+
+static int sEnabled = -1;
+static int sVerify = -1;
+
+static bool sOpened = false;
+static char* sFileName = NULL;
+static char* sData = NULL;      // contents of the cache file from the previous run
+static size_t sDataSize = 0;
+
+static std::map<std::string,const CacheRecord*> sLoaded;    // records in sData
+static bool sDropped = false;                               // ... leaving out damaged ones
+static std::set<std::string> sUsed;                         // ... of which these were needed again
+static std::map<std::string,std::string> sNew;              // records made in this run
+
+static bool
+varIsTrue(const char* name)
+{
+    char* v = kpse_var_value(name);
+    bool result = (v != NULL && (*v == '1' || *v == 'y' || *v == 't'));
+    free(v);
+    return result;
+}
+
+bool
+shapingCacheEnabled()
+{
+    if (sEnabled < 0)
+        sEnabled = varIsTrue("xetex_shaping_cache");
+    return sEnabled;
+}
+
+bool
+shapingCacheVerify()
+{
+    if (sVerify < 0)
+        sVerify = varIsTrue("xetex_shaping_cache_verify");
+    return sVerify;
+}
+
+bool
+getFontFileDigest(const char* pathname, unsigned char digest[SHAPING_CACHE_KEY_SIZE])
+{
+    static std::map<std::string,std::string> sDigests;
+
+    std::map<std::string,std::string>::const_iterator i = sDigests.find(pathname);
+    if (i == sDigests.end()) {
+        FILE* f = fopen(pathname, FOPEN_RBIN_MODE);
+        if (f == NULL)
+            return false;
+
+        md5_state_t state;
+        md5_byte_t buf[8192];
+        md5_byte_t result[SHAPING_CACHE_KEY_SIZE];
+        size_t n;
+        md5_init(&state);
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            md5_append(&state, buf, n);
+        md5_finish(&state, result);
+        fclose(f);
+
+        i = sDigests.insert(std::make_pair(std::string(pathname),
+                                           std::string((const char*)result, sizeof(result)))).first;
+    }
+
+    memcpy(digest, i->second.data(), SHAPING_CACHE_KEY_SIZE);
+    return true;
+}
+
+// a damaged or stale record could make layoutChars' callers read beyond the text,
+// or beyond the shaper name
+static bool
+validRecord(const CacheRecord* record)
+{
+    if (memchr(record->shaper, 0, SHAPER_NAME_SIZE) == NULL || record->start > record->end)
+        return false;
+
+    const CacheGlyph* glyphs = (const CacheGlyph*) (record + 1);
+    for (uint32_t n = 0; n < record->glyphCount; n++)
+        if (glyphs[n].cluster < record->start || glyphs[n].cluster >= record->end)
+            return false;
+    return true;
+}
+
+static void
+loadShapingCache()
+{
+#ifdef _WIN32
+    FILE* f = fopen(sFileName, FOPEN_RBIN_MODE);
+    if (f == NULL)
+        return;
+    fseek(f, 0, SEEK_END);
+    sDataSize = ftell(f);
+    rewind(f);
+    sData = (char*) xmalloc(sDataSize);
+    if (fread(sData, 1, sDataSize, f) != sDataSize)
+        sDataSize = 0;
+    fclose(f);
+#else
+    struct stat st;
+    int fd = open(sFileName, O_RDONLY);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            sData = (char*) p;
+            sDataSize = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+
+    const CacheHeader* header = (const CacheHeader*) sData;
+    if (sDataSize < sizeof(CacheHeader)
+            || memcmp(header->magic, SHAPING_CACHE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SHAPING_CACHE_VERSION)
+        return; // not a cache we can use; it will be replaced
+
+    size_t pos = sizeof(CacheHeader);
+    for (uint32_t n = 0; n < header->count; n++) {
+        const CacheRecord* record = (const CacheRecord*) (sData + pos);
+        if (pos + sizeof(CacheRecord) > sDataSize
+                || record->glyphCount > (sDataSize - pos - sizeof(CacheRecord)) / sizeof(CacheGlyph))
+            break;
+        size_t size = sizeof(CacheRecord) + record->glyphCount * sizeof(CacheGlyph);
+        if (validRecord(record))
+            sLoaded[std::string((const char*)record->key, SHAPING_CACHE_KEY_SIZE)] = record;
+        else
+            sDropped = true;
+        pos += size;
+    }
+}
+
+static bool
+openShapingCache()
+{
+    if (!sOpened) {
+        // the cache lives with the job's other output, so we need its name first
+        sFileName = get_shaping_cache_name();
+        if (sFileName == NULL)
+            return false;
+        sOpened = true;
+        loadShapingCache();
+    }
+    return true;
+}
+
+bool
+lookupShapingCache(const unsigned char key[SHAPING_CACHE_KEY_SIZE], uint32_t start, uint32_t end,
+                   hb_buffer_t* buffer, const char** shaper)
+{
+    if (!openShapingCache())
+        return false;
+
+    std::string k((const char*)key, SHAPING_CACHE_KEY_SIZE);
+    const CacheRecord* record;
+
+    std::map<std::string,std::string>::const_iterator i = sNew.find(k);
+    if (i != sNew.end()) {
+        record = (const CacheRecord*) i->second.data();
+    } else {
+        std::map<std::string,const CacheRecord*>::const_iterator j = sLoaded.find(k);
+        if (j == sLoaded.end())
+            return false;
+        record = j->second;
+        if (record->start != start || record->end != end)
+            return false;
+        sUsed.insert(k);
+    }
+
+    const CacheGlyph* glyphs = (const CacheGlyph*) (record + 1);
+
+    hb_buffer_reset(buffer);
+    for (uint32_t n = 0; n < record->glyphCount; n++)
+        hb_buffer_add(buffer, glyphs[n].codepoint, glyphs[n].cluster);
+    hb_buffer_set_content_type(buffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
+
+    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(buffer, NULL);
+    hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(buffer, NULL);
+    for (uint32_t n = 0; n < record->glyphCount; n++) {
+        info[n].mask = glyphs[n].flags;
+        pos[n].x_advance = glyphs[n].xAdvance;
+        pos[n].y_advance = glyphs[n].yAdvance;
+        pos[n].x_offset = glyphs[n].xOffset;
+        pos[n].y_offset = glyphs[n].yOffset;
+    }
+
+    *shaper = record->shaper;
+    return true;
+}
+
+void
+storeShapingCache(const unsigned char key[SHAPING_CACHE_KEY_SIZE], uint32_t start, uint32_t end,
+                  hb_buffer_t* buffer, const char* shaper)
+{
+    if (!openShapingCache())
+        return;
+
+    unsigned int glyphCount;
+    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(buffer, &glyphCount);
+    hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(buffer, NULL);
+
+    CacheRecord record;
+    memcpy(record.key, key, SHAPING_CACHE_KEY_SIZE);
+    record.start = start;
+    record.end = end;
+    record.glyphCount = glyphCount;
+    memset(record.shaper, 0, SHAPER_NAME_SIZE);
+    strncpy(record.shaper, shaper, SHAPER_NAME_SIZE - 1);
+
+    std::string data((const char*)&record, sizeof(record));
+    for (unsigned int n = 0; n < glyphCount; n++) {
+        CacheGlyph g;
+        g.codepoint = info[n].codepoint;
+        g.cluster = info[n].cluster;
+        g.flags = info[n].mask & GLYPH_FLAGS;
+        g.xAdvance = pos[n].x_advance;
+        g.yAdvance = pos[n].y_advance;
+        g.xOffset = pos[n].x_offset;
+        g.yOffset = pos[n].y_offset;
+        data.append((const char*)&g, sizeof(g));
+    }
+
+    sNew[std::string((const char*)key, SHAPING_CACHE_KEY_SIZE)] = data;
+}
+
+bool
+sameShaping(hb_buffer_t* a, hb_buffer_t* b)
+{
+    unsigned int countA, countB;
+    hb_glyph_info_t* infoA = hb_buffer_get_glyph_infos(a, &countA);
+    hb_glyph_info_t* infoB = hb_buffer_get_glyph_infos(b, &countB);
+    hb_glyph_position_t* posA = hb_buffer_get_glyph_positions(a, NULL);
+    hb_glyph_position_t* posB = hb_buffer_get_glyph_positions(b, NULL);
+
+    if (countA != countB)
+        return false;
+    for (unsigned int n = 0; n < countA; n++) {
+        if (infoA[n].codepoint != infoB[n].codepoint
+                || infoA[n].cluster != infoB[n].cluster
+                || (infoA[n].mask & GLYPH_FLAGS) != (infoB[n].mask & GLYPH_FLAGS)
+                || posA[n].x_advance != posB[n].x_advance
+                || posA[n].y_advance != posB[n].y_advance
+                || posA[n].x_offset != posB[n].x_offset
+                || posA[n].y_offset != posB[n].y_offset)
+            return false;
+    }
+    return true;
+}
+
+void
+saveShapingCache()
+{
+    // records that were neither used nor made in this run are dropped
+    if (!sOpened || (sNew.empty() && sUsed.size() == sLoaded.size() && !sDropped))
+        return;
+
+    char* tmpName = concat(sFileName, ".tmp");
+    FILE* f = fopen(tmpName, FOPEN_WBIN_MODE);
+    if (f == NULL) {
+        free(tmpName);
+        return;
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, SHAPING_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SHAPING_CACHE_VERSION;
+    header.count = 0;
+    fwrite(&header, sizeof(header), 1, f);
+
+    size_t size = sizeof(header);
+    for (std::map<std::string,std::string>::const_iterator i = sNew.begin(); i != sNew.end(); ++i) {
+        if (size + i->second.size() > SHAPING_CACHE_MAX_SIZE)
+            break;
+        fwrite(i->second.data(), i->second.size(), 1, f);
+        size += i->second.size();
+        header.count++;
+    }
+    for (std::set<std::string>::const_iterator i = sUsed.begin(); i != sUsed.end(); ++i) {
+        if (sNew.find(*i) != sNew.end())
+            continue; // superseded
+        const CacheRecord* record = sLoaded[*i];
+        size_t recordSize = sizeof(CacheRecord) + record->glyphCount * sizeof(CacheGlyph);
+        if (size + recordSize > SHAPING_CACHE_MAX_SIZE)
+            break;
+        fwrite(record, recordSize, 1, f);
+        size += recordSize;
+        header.count++;
+    }
+
+    rewind(f);
+    fwrite(&header, sizeof(header), 1, f);
+    bool ok = (fclose(f) == 0);
+
+#ifdef _WIN32
+    free(sData);
+#else
+    if (sData != NULL)
+        munmap(sData, sDataSize);
+#endif
+    sData = NULL;
+    sLoaded.clear();
+
+    if (ok) {
+#ifdef _WIN32
+        remove(sFileName);
+#endif
+        ok = (rename(tmpName, sFileName) == 0);
+    }
+    if (!ok)
+        remove(tmpName);
+    free(tmpName);
+}
@@ -0,0 +1,60 @@
+/****************************************************************************\
+ Part of the XeTeX typesetting system
+ Copyright (c) 2024 by the XeTeX Project
+
+Permission is hereby granted, free of charge, to any person obtaining
+a copy of this software and associated documentation files (the
+"Software"), to deal in the Software without restriction, including
+without limitation the rights to use, copy, modify, merge, publish,
+distribute, sublicense, and/or sell copies of the Software, and to
+permit persons to whom the Software is furnished to do so, subject to
+the following conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE
+FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of the copyright holders
+shall not be used in advertising or otherwise to promote the sale,
+use or other dealings in this Software without prior written
+authorization from the copyright holders.
+\****************************************************************************/
+
+/*
+ * An optional cache of shaping results that persists across runs. Documents
+ * are typically processed several times with (almost) the same text, so the
+ * glyph runs HarfBuzz produced last time can be reused. It is enabled by
+ * setting xetex_shaping_cache to true in texmf.cnf or the environment; with
+ * xetex_shaping_cache_verify also true, cached results are checked against
+ * live shaping.
+ */
+
+#ifndef __XeTeXShapeCache_H
+#define __XeTeXShapeCache_H
+
+#include <hb.h>
+
+#define SHAPING_CACHE_KEY_SIZE  16  /* the key is an MD5 digest of everything that affects shaping */
+
+bool shapingCacheEnabled();
+bool shapingCacheVerify();
+
+bool getFontFileDigest(const char* pathname, unsigned char digest[SHAPING_CACHE_KEY_SIZE]);
+
+/* start..end is the range of the shaped text, which the glyph clusters must lie in */
+bool lookupShapingCache(const unsigned char key[SHAPING_CACHE_KEY_SIZE], uint32_t start, uint32_t end,
+                        hb_buffer_t* buffer, const char** shaper);
+void storeShapingCache(const unsigned char key[SHAPING_CACHE_KEY_SIZE], uint32_t start, uint32_t end,
+                       hb_buffer_t* buffer, const char* shaper);
+bool sameShaping(hb_buffer_t* a, hb_buffer_t* b);
+
+void saveShapingCache();
+
+#endif
@@ -36,6 +36,10 @@ authorization from the copyright holders.
  * additional plain C extensions for XeTeX - mostly platform-neutral
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1 /* for fopencookie() */
+#endif
+
 #include <w2c/config.h>
 
 /* 
@@ -71,6 +75,7 @@ authorization from the copyright holders.
 #include <kpathsea/readable.h>
 #include <kpathsea/variable.h>
 #include <kpathsea/absolute.h>
+#include <kpathsea/c-stat.h>
 #if defined(WIN32)
 #include <kpathsea/concatn.h>
 #endif
@@ -88,11 +93,38 @@ authorization from the copyright holders.
 #include "XeTeXswap.h"
 
 #include <unicode/ubidi.h>
+#include <unicode/uchar.h>
 #include <unicode/ubrk.h>
 #include <unicode/ucnv.h>
+#include <unicode/uloc.h>
+#include <unicode/unorm2.h>
+#include <unicode/utf16.h>
 
 #include <assert.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifndef WIN32
+#include <spawn.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+extern char** environ;
+#endif
+
+/* XDV output can go through a queue drained by a separate writer thread
+   where stdio lets us supply our own write function */
+#if !defined(WIN32) && (defined(__GLIBC__) || defined(__APPLE__) \
+    || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
+#define XETEX_OUTPUT_QUEUE 1
+#include <pthread.h>
+#endif
+
 /* for reading input files, we don't need the default locking routines
    as xetex is a single-threaded program */
 #ifdef WIN32
@@ -231,12 +263,15 @@ void initversionstring(char **versions)
 }
 
 
+static void release_input_block(UFILE* f);
+
 void
 setinputfileencoding(UFILE* f, integer mode, integer encodingData)
 {
     if ((f->encodingMode == ICUMAPPING) && (f->conversionData != NULL))
         ucnv_close((UConverter*)(f->conversionData));
     f->conversionData = 0;
+    release_input_block(f);
 
     switch (mode) {
         case UTF8:
@@ -291,50 +326,477 @@ conversion_error(int errcode)
     enddiagnostic(1);
 }
 
+/* normalize buffer[first..last) in place (norm: 1 = NFC, 2 = NFD); only
+   the part of the line from the first character that may change is
+   converted to UTF-16 and passed to ICU */
+static void
+apply_normalization(int norm)
+{
+    static UChar* text = NULL;
+    static UChar* normText = NULL;
+    static int32_t textSize = 0, normSize = 0;
+
+    const UNormalizer2* normalizer;
+    UErrorCode status = U_ZERO_ERROR;
+    int32_t textLen, span, normLen;
+    int start, k;
+
+    /* ASCII is unchanged by normalization, and nothing combines with it
+       from before, so there is a normalization boundary before each ASCII
+       character */
+    for (start = first; start < last && buffer[start] < 0x80; ++start)
+        ;
+    if (start == last)
+        return;
+    if (start > first)
+        --start;
+
+    normalizer = (norm == 1) ? unorm2_getNFCInstance(&status) : unorm2_getNFDInstance(&status);
+    if (U_FAILURE(status)) {
+        fprintf(stderr, "! Failed to create normalizer: error code = %d\n", (int)status);
+        uexit (1);
+    }
+
+    if (textSize < 2 * (last - start)) {
+        textSize = 2 * bufsize;
+        text = (UChar*) xrealloc(text, textSize * sizeof(UChar));
+    }
+    textLen = 0;
+    for (k = start; k < last; ++k) {
+        if (U_IS_SURROGATE(buffer[k]) || buffer[k] > 0x10ffff)
+            return; /* not representable in UTF-16; leave the line alone */
+        U16_APPEND_UNSAFE(text, textLen, buffer[k]);
+    }
+
+    span = unorm2_spanQuickCheckYes(normalizer, text, textLen, &status);
+    if (U_FAILURE(status) || span == textLen)
+        return;
+
+    /* the characters before span are already normalized; span is at a
+       normalization boundary, so the rest can be normalized on its own */
+    for (k = 0; k < span; ++k)
+        if (!U16_IS_TRAIL(text[k]))
+            ++start;
+
+    for (;;) {
+        status = U_ZERO_ERROR;
+        normLen = unorm2_normalize(normalizer, text + span, textLen - span, normText, normSize, &status);
+        if (status != U_BUFFER_OVERFLOW_ERROR)
+            break;
+        normSize = normLen + 1;
+        normText = (UChar*) xrealloc(normText, normSize * sizeof(UChar));
+    }
+    if (U_FAILURE(status))
+        return;
+
+    last = start;
+    for (k = 0; k < normLen; ) {
+        UChar32 c;
+        if (last >= bufsize)
+            buffer_overflow();
+        U16_NEXT_UNSAFE(normText, k, c);
+        buffer[last++] = c;
+    }
+}
+
 #ifdef WORDS_BIGENDIAN
-#define NATIVE_UTF32    kForm_UTF32BE
+#define UCNV_UTF32_NativeEndian UCNV_UTF32_BigEndian
 #else
-#define NATIVE_UTF32    kForm_UTF32LE
+#define UCNV_UTF32_NativeEndian UCNV_UTF32_LittleEndian
+#endif
+
+/* Input files that are regular files, in UTF-8, UTF-16 or raw bytes, are
+   memory-mapped where possible, or else read in large blocks, rather than
+   read a character at a time through get_uni_c; this covers \input and
+   \openin/\read files alike. The UFILE structure belongs to the web2c
+   library, so the block for each file is kept in a side table here.
+   Decoding gives exactly the same characters (and bad UTF-8 warnings) as
+   get_uni_c would. */
+
+#define INPUT_BLOCK_SIZE    65536
+#define INPUT_BLOCK_SLACK   4       /* longest sequence we decode in one piece */
+
+typedef struct inputBlock {
+    struct inputBlock*  next;
+    UFILE*              f;
+    int                 usable;     /* is the file read through this block? */
+    int                 eof;        /* is the rest of the file in buf? */
+    unsigned char*      buf;        /* the whole file if mapped, else a block of it */
+    size_t              pos;        /* next unread byte in buf */
+    size_t              len;
+    void*               map;        /* if the file is mapped, the mapping (of len bytes) */
+    int                 pending;    /* as UFILE.savedChar, for UTF-16 */
+} inputBlock;
+
+static inputBlock* inputBlocks = NULL;
+
+#ifndef _WIN32
+/* Files opened for writing in this run are not mapped, as truncating a
+   mapped file would make the next access to the mapping raise SIGBUS
+   instead of giving EOF; see releasemappedinput. */
+typedef struct {
+    dev_t   dev;
+    ino_t   ino;
+} fileId;
+
+static fileId* outputFiles = NULL;
+static int outputFileCount = 0;
+
+static int
+is_output_file(const struct stat* st)
+{
+    int i;
+    for (i = 0; i < outputFileCount; ++i)
+        if (outputFiles[i].dev == st->st_dev && outputFiles[i].ino == st->st_ino)
+            return 1;
+    return 0;
+}
+#endif
+
+static inputBlock*
+find_input_block(UFILE* f)
+{
+    inputBlock* b;
+    for (b = inputBlocks; b != NULL; b = b->next)
+        if (b->f == f)
+            return b;
+    return NULL;
+}
+
+static inputBlock*
+get_input_block(UFILE* f)
+{
+    inputBlock* b = find_input_block(f);
+    struct stat st;
+
+    if (b == NULL) {
+        b = (inputBlock*) xmalloc(sizeof(inputBlock));
+        b->f = f;
+        b->usable = fstat(fileno(f->f), &st) == 0 && S_ISREG(st.st_mode);
+        b->eof = 0;
+        b->buf = NULL;
+        b->pos = b->len = 0;
+        b->map = NULL;
+        b->pending = -1;
+        b->next = inputBlocks;
+        inputBlocks = b;
+
+#ifndef _WIN32
+        if (b->usable && st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size
+                && !is_output_file(&st)) {
+            long offset = ftell(f->f);
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f->f), 0);
+            if (offset >= 0 && map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+                b->map = map;
+                b->buf = (unsigned char*) map;
+                b->len = st.st_size;
+                b->pos = ((size_t)offset < b->len) ? (size_t)offset : b->len;
+                b->eof = 1;
+            } else if (map != MAP_FAILED)
+                munmap(map, st.st_size);
+        }
+#endif
+        if (b->usable && b->map == NULL)
+            b->buf = (unsigned char*) xmalloc(INPUT_BLOCK_SIZE + INPUT_BLOCK_SLACK);
+    }
+
+    return b->usable ? b : NULL;
+}
+
+/* stop reading f through its block, leaving the file positioned at the first unread byte */
+static void
+release_input_block(UFILE* f)
+{
+    inputBlock** bp;
+    for (bp = &inputBlocks; *bp != NULL; bp = &(*bp)->next) {
+        inputBlock* b = *bp;
+        if (b->f == f) {
+#ifndef _WIN32
+            if (b->map != NULL) {
+                fseek(f->f, (long)b->pos, SEEK_SET);
+                munmap(b->map, b->len);
+            } else
+#endif
+            {
+                if (b->len > b->pos)
+                    fseek(f->f, -(long)(b->len - b->pos), SEEK_CUR);
+                free(b->buf);
+            }
+            if (b->pending != -1)
+                f->savedChar = b->pending;
+            *bp = b->next;
+            free(b);
+            return;
+        }
+    }
+}
+
+#ifndef _WIN32
+static void
+unmap_input_block(inputBlock* b)
+{
+    /* go on reading the file with fread, from where we had got to */
+    fseek(b->f->f, (long)b->pos, SEEK_SET);
+    munmap(b->map, b->len);
+    b->map = NULL;
+    b->buf = (unsigned char*) xmalloc(INPUT_BLOCK_SIZE + INPUT_BLOCK_SLACK);
+    b->pos = b->len = 0;
+    b->eof = 0;
+}
+
+static void
+unmap_if_same_file(const char* name)
+{
+    struct stat st;
+    inputBlock* b;
+
+    if (stat(name, &st) != 0)
+        return;
+    for (b = inputBlocks; b != NULL; b = b->next) {
+        struct stat mapped;
+        if (b->map != NULL && fstat(fileno(b->f->f), &mapped) == 0
+                && mapped.st_dev == st.st_dev && mapped.st_ino == st.st_ino)
+            unmap_input_block(b);
+    }
+}
 #endif
 
+void
+releasemappedinput(void)
+{
+    /* nameoffile is about to be opened for writing, which truncates it; if
+       we are reading it, stop using the mapping, so that reading it after
+       that gives EOF as it would through stdio */
+#ifndef _WIN32
+    unmap_if_same_file((const char*)nameoffile+1);
+    if (output_directory && !kpse_absolute_p((const char*)nameoffile+1, false)) {
+        char* fullname = concat3(output_directory, DIR_SEP_STRING, (const char*)nameoffile+1);
+        unmap_if_same_file(fullname);
+        free(fullname);
+    }
+#endif
+}
+
+void
+noteoutputfile(FILE* f)
+{
+    /* f has been opened for writing; it won't be mapped if it is read */
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && !is_output_file(&st)) {
+        outputFiles = (fileId*) xrealloc(outputFiles, (outputFileCount + 1) * sizeof(fileId));
+        outputFiles[outputFileCount].dev = st.st_dev;
+        outputFiles[outputFileCount].ino = st.st_ino;
+        outputFileCount++;
+    }
+#endif
+}
+
+/* make sure at least n bytes are available unless the file ends first */
 static void
-apply_normalization(uint32_t* buf, int len, int norm)
+fill_input_block(inputBlock* b, size_t n)
 {
-    static TECkit_Converter normalizers[2] = { NULL, NULL };
+    if (b->len - b->pos >= n || b->eof)
+        return;
 
-    TECkit_Status status;
-    UInt32 inUsed, outUsed;
-    TECkit_Converter *normPtr = &normalizers[norm - 1];
-    if (*normPtr == NULL) {
-        status = TECkit_CreateConverter(NULL, 0, 1,
-            NATIVE_UTF32, NATIVE_UTF32 | (norm == 1 ? kForm_NFC : kForm_NFD),
-            &*normPtr);
-        if (status != kStatus_NoError) {
-            fprintf(stderr, "! Failed to create normalizer: error code = %d\n", (int)status);
-            uexit (1);
+    memmove(b->buf, b->buf + b->pos, b->len - b->pos);
+    b->len -= b->pos;
+    b->pos = 0;
+
+    while (b->len < n && !b->eof) {
+        size_t got = fread(b->buf + b->len, 1, INPUT_BLOCK_SIZE - b->len, b->f->f);
+        if (got == 0)
+            b->eof = 1;
+        b->len += got;
+    }
+}
+
+/* the bytes-to-character part of get_uni_c, for a sequence starting at buf[pos] */
+static int
+decode_utf8_block(inputBlock* b)
+{
+    const unsigned char* p = b->buf + b->pos;
+    size_t avail = b->len - b->pos;
+    int rval = *p;
+    uint16_t extraBytes = bytesFromUTF8[rval];
+    size_t n;
+
+    if (extraBytes >= 4) {
+        b->pos += 1;
+        badutf8warning();
+        return 0xfffd;
+    }
+
+    for (n = 1; n <= extraBytes; ++n) {
+        if (n >= avail || p[n] < 0x80 || p[n] >= 0xc0) {
+            /* the bad byte is left to be read again */
+            b->pos += n;
+            badutf8warning();
+            return 0xfffd;
         }
+        rval <<= 6;
+        rval += p[n];
     }
+    b->pos += n;
 
-    status = TECkit_ConvertBuffer(*normPtr, (Byte*)buf, len * sizeof(UInt32), &inUsed,
-                (Byte*)&buffer[first], sizeof(*buffer) * (bufsize - first), &outUsed, 1);
-    TECkit_ResetConverter(*normPtr);
-    if (status != kStatus_NoError)
-        buffer_overflow();
-    last = first + outUsed / sizeof(*buffer);
+    rval -= offsetsFromUTF8[extraBytes];
+    if (rval < 0 || rval > 0x10ffff) {
+        badutf8warning();
+        return 0xfffd;
+    }
+    return rval;
 }
 
-#ifdef WORDS_BIGENDIAN
-#define UCNV_UTF32_NativeEndian UCNV_UTF32_BigEndian
-#else
-#define UCNV_UTF32_NativeEndian UCNV_UTF32_LittleEndian
+/* the next byte, or EOF, as GETC would give it */
+static int
+next_block_byte(inputBlock* b)
+{
+    return (b->pos < b->len) ? b->buf[b->pos++] : EOF;
+}
+
+/* the UTF-16 part of get_uni_c */
+static int
+decode_utf16_block(inputBlock* b, int bigEndian)
+{
+    int rval, lo, b1, b2;
+
+    if (b->pending != -1) {
+        rval = b->pending;
+        b->pending = -1;
+        return rval;
+    }
+
+    fill_input_block(b, INPUT_BLOCK_SLACK);
+    if (b->pos == b->len)
+        return EOF;
+
+    b1 = next_block_byte(b);
+    b2 = next_block_byte(b);
+    rval = bigEndian ? b1 * 256 + b2 : b1 + b2 * 256;
+    if (rval >= 0xd800 && rval <= 0xdbff) {
+        b1 = next_block_byte(b);
+        b2 = next_block_byte(b);
+        lo = bigEndian ? b1 * 256 + b2 : b1 + b2 * 256;
+        if (lo >= 0xdc00 && lo <= 0xdfff)
+            rval = 0x10000 + (rval - 0xd800) * 0x400 + (lo - 0xdc00);
+        else {
+            rval = 0xfffd;
+            b->pending = lo;
+        }
+    } else if (rval >= 0xdc00 && rval <= 0xdfff)
+        rval = 0xfffd;
+
+    return rval;
+}
+
+static int
+input_block_line_utf16(UFILE* f, inputBlock* b)
+{
+    int bigEndian = (f->encodingMode == UTF16BE);
+    int i = decode_utf16_block(b, bigEndian);
+
+    if (f->skipNextLF) {
+        f->skipNextLF = 0;
+        if (i == '\n')
+            i = decode_utf16_block(b, bigEndian);
+    }
+
+    while (i != EOF && i != '\n' && i != '\r') {
+        if (last >= bufsize)
+            return i; /* not a line end, so input_line reports the overflow */
+        buffer[last++] = i;
+        i = decode_utf16_block(b, bigEndian);
+    }
+
+    return i;
+}
+
+/* read characters into buffer[last..] up to the end of the line; returns
+   the character that ended it (EOF, '\n' or '\r'), or another character
+   if buffer is full, just as the get_uni_c loop in input_line does */
+static int
+input_block_line(UFILE* f, inputBlock* b)
+{
+    int utf8 = (f->encodingMode == UTF8);
+
+    if (f->encodingMode == UTF16BE || f->encodingMode == UTF16LE)
+        return input_block_line_utf16(f, b);
+
+    if (f->skipNextLF) {
+        f->skipNextLF = 0;
+        fill_input_block(b, 1);
+        if (b->pos < b->len && b->buf[b->pos] == '\n')
+            ++b->pos;
+    }
+
+    for (;;) {
+        const unsigned char* p;
+        const unsigned char* end;
+
+        if (last >= bufsize)
+            return 0; /* not a line end, so input_line reports the overflow */
+
+        fill_input_block(b, INPUT_BLOCK_SLACK);
+        if (b->pos == b->len)
+            return EOF;
+
+        p = b->buf + b->pos;
+        end = b->buf + b->len;
+
+#if defined(__SSE2__)
+        /* runs of ASCII other than CR and LF, 16 bytes at a time */
+        if (sizeof(*buffer) == 4) {
+            const __m128i cr = _mm_set1_epi8('\r');
+            const __m128i lf = _mm_set1_epi8('\n');
+            const __m128i zero = _mm_setzero_si128();
+            while (end - p >= 16 && last + 16 <= bufsize) {
+                __m128i v = _mm_loadu_si128((const __m128i*)p);
+                __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf));
+                __m128i lo, hi;
+                if (_mm_movemask_epi8(_mm_or_si128(stop, v)) != 0)
+                    break; /* CR, LF or a byte >= 0x80 */
+                lo = _mm_unpacklo_epi8(v, zero);
+                hi = _mm_unpackhi_epi8(v, zero);
+                _mm_storeu_si128((__m128i*)&buffer[last], _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)&buffer[last + 4], _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)&buffer[last + 8], _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i*)&buffer[last + 12], _mm_unpackhi_epi16(hi, zero));
+                last += 16;
+                p += 16;
+            }
+        }
 #endif
 
+        while (p < end && last < bufsize) {
+            int c = *p;
+            if (c == '\n' || c == '\r') {
+                b->pos = p + 1 - b->buf;
+                return c;
+            }
+            if (c >= 0x80 && utf8) {
+                if (end - p < INPUT_BLOCK_SLACK && !b->eof)
+                    break; /* get the rest of the sequence first */
+                b->pos = p - b->buf;
+                buffer[last++] = decode_utf8_block(b);
+                p = b->buf + b->pos;
+                continue;
+            }
+            buffer[last++] = c;
+            ++p;
+        }
+        b->pos = p - b->buf;
+    }
+}
+
 int
 input_line(UFILE* f)
 {
 static char* byteBuffer = NULL;
-static uint32_t *utf32Buf = NULL;
-    int i, tmpLen;
+    int i, outLen;
+    inputBlock* block;
     int norm = getinputnormalizationstate();
 #ifdef WIN32
     const int fd = fileno(f->f);
@@ -348,7 +810,6 @@ static uint32_t *utf32Buf = NULL;
     if (f->encodingMode == ICUMAPPING) {
         uint32_t bytesRead = 0;
         UConverter* cnv;
-        int outLen;
         UErrorCode errorCode = U_ZERO_ERROR;
 
         if (byteBuffer == NULL)
@@ -376,33 +837,26 @@ static uint32_t *utf32Buf = NULL;
 
         /* now apply the mapping to turn external bytes into Unicode characters in buffer */
         cnv = (UConverter*)(f->conversionData);
-        switch (norm) {
-            case 1: // NFC
-            case 2: // NFD
-                if (utf32Buf == NULL)
-                    utf32Buf = (uint32_t*) xcalloc(bufsize, sizeof(uint32_t));
-                tmpLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
-                                            (char*)utf32Buf, bufsize * sizeof(*utf32Buf),
-                                            byteBuffer, bytesRead, &errorCode);
-                if (errorCode != 0) {
-                    conversion_error((int)errorCode);
-                    return false;
-                }
-                apply_normalization(utf32Buf, tmpLen / sizeof(*utf32Buf), norm); // sets 'last' correctly
-                break;
-
-            default: // none
-                outLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
-                                            (char*)&buffer[first], sizeof(*buffer) * (bufsize - first),
-                                            byteBuffer, bytesRead, &errorCode);
-                if (errorCode != 0) {
-                    conversion_error((int)errorCode);
-                    return false;
-                }
-                outLen /= sizeof(*buffer);
-                last = first + outLen;
-                break;
+        outLen = ucnv_toAlgorithmic(UCNV_UTF32_NativeEndian, cnv,
+                                    (char*)&buffer[first], sizeof(*buffer) * (bufsize - first),
+                                    byteBuffer, bytesRead, &errorCode);
+        if (errorCode != 0) {
+            conversion_error((int)errorCode);
+            return false;
         }
+        outLen /= sizeof(*buffer);
+        last = first + outLen;
+    } else if ((f->encodingMode == UTF8 || f->encodingMode == RAW
+                || f->encodingMode == UTF16BE || f->encodingMode == UTF16LE) && f->savedChar == -1
+               && (block = get_input_block(f)) != NULL) {
+        i = input_block_line(f, block);
+
+        if (i == EOF && last == first)
+            return false;
+
+        /* We didn't get the whole line because our buffer was too small.  */
+        if (i != EOF && i != '\n' && i != '\r')
+            buffer_overflow();
     } else {
         /* Recognize either LF or CR as a line terminator; skip initial LF if prev line ended with CR.  */
         i = get_uni_c(f);
@@ -412,49 +866,27 @@ static uint32_t *utf32Buf = NULL;
                 i = get_uni_c(f);
         }
 
-        switch (norm) {
-            case 1: // NFC
-            case 2: // NFD
-                // read Unicode chars into utf32Buf as UTF32
-                if (utf32Buf == NULL)
-                    utf32Buf = (uint32_t*) xcalloc(bufsize, sizeof(uint32_t));
-                tmpLen = 0;
-                if (i != EOF && i != '\n' && i != '\r')
-                    utf32Buf[tmpLen++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (tmpLen < bufsize && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        utf32Buf[tmpLen++] = i;
-
-                if (i == EOF && errno != EINTR && tmpLen == 0)
-                    return false;
-
-                /* We didn't get the whole line because our buffer was too small.  */
-                if (i != EOF && i != '\n' && i != '\r')
-                    buffer_overflow();
-                apply_normalization(utf32Buf, tmpLen, norm);
-                break;
-
-            default: // none
 #ifdef WIN32
-                if (f->encodingMode == WIN32CONSOLE && i == 0x1a) /* Ctrl+Z */
-                    return false;
+        if (f->encodingMode == WIN32CONSOLE && i == 0x1a) /* Ctrl+Z */
+            return false;
 #endif
-                if (last < bufsize && i != EOF && i != '\n' && i != '\r')
-                    buffer[last++] = i;
-                if (i != EOF && i != '\n' && i != '\r')
-                    while (last < bufsize && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
-                        buffer[last++] = i;
+        if (last < bufsize && i != EOF && i != '\n' && i != '\r')
+            buffer[last++] = i;
+        if (i != EOF && i != '\n' && i != '\r')
+            while (last < bufsize && (i = get_uni_c(f)) != EOF && i != '\n' && i != '\r')
+                buffer[last++] = i;
 
-                if (i == EOF && errno != EINTR && last == first)
-                    return false;
+        if (i == EOF && errno != EINTR && last == first)
+            return false;
 
-                /* We didn't get the whole line because our buffer was too small.  */
-                if (i != EOF && i != '\n' && i != '\r')
-                    buffer_overflow();
-                break;
-        }
+        /* We didn't get the whole line because our buffer was too small.  */
+        if (i != EOF && i != '\n' && i != '\r')
+            buffer_overflow();
     }
 
+    if (norm == 1 || norm == 2) /* NFC or NFD */
+        apply_normalization(norm);
+
     /* If line ended with CR, remember to skip following LF. */
     if (i == '\r')
         f->skipNextLF = 1;
@@ -478,46 +910,133 @@ static void die(const_string s, int i)
     exit(3);
 }
 
+/* Line break iterators are kept for the last few locales used, as documents
+   often switch back and forth between a couple of them, and opening one
+   (with its rules and dictionaries) is expensive. */
+#define BRK_POOL_SIZE   8
+
+typedef struct {
+    integer         localeStrNum;   /* the last string number seen for this locale */
+    char            name[ULOC_FULLNAME_CAPACITY];   /* canonical locale name */
+    int             graphite;       /* locale "G": use Graphite breaking if the font has it */
+    UBreakIterator* iter;           /* opened when first needed */
+} brkPoolEntry;
+
+static brkPoolEntry brkPool[BRK_POOL_SIZE]; /* most recently used first */
+static int brkPoolCount = 0;
 static UBreakIterator* brkIter = NULL;
-static int brkLocaleStrNum = 0;
+static XeTeXLayoutEngine grBreakEngine = NULL; /* set when Graphite is doing the breaking */
+
+static void
+brk_pool_to_front(int i)
+{
+    if (i > 0) {
+        brkPoolEntry e = brkPool[i];
+        memmove(&brkPool[1], &brkPool[0], i * sizeof(brkPoolEntry));
+        brkPool[0] = e;
+    }
+}
+
+static brkPoolEntry*
+brk_pool_entry(integer localeStrNum)
+{
+    UErrorCode status = U_ZERO_ERROR;
+    char name[ULOC_FULLNAME_CAPACITY];
+    char* locale;
+    int graphite;
+    int i;
+
+    for (i = 0; i < brkPoolCount; ++i)
+        if (brkPool[i].localeStrNum == localeStrNum) {
+            brk_pool_to_front(i);
+            return &brkPool[0];
+        }
+
+    /* not seen under this string number; look it up by name */
+    locale = (char*)gettexstring(localeStrNum);
+    graphite = (strcmp(locale, "G") == 0);
+    uloc_canonicalize(locale, name, sizeof(name), &status);
+    if (U_FAILURE(status) || status == U_STRING_NOT_TERMINATED_WARNING) {
+        strncpy(name, locale, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+    }
+    free(locale);
+
+    for (i = 0; i < brkPoolCount; ++i)
+        if (brkPool[i].graphite == graphite && strcmp(brkPool[i].name, name) == 0)
+            break;
+
+    if (i == brkPoolCount) {
+        if (brkPoolCount < BRK_POOL_SIZE)
+            ++brkPoolCount;
+        else {
+            /* reuse the least recently used entry */
+            --i;
+            if (brkPool[i].iter != NULL) {
+                if (brkPool[i].iter == brkIter)
+                    brkIter = NULL;
+                ubrk_close(brkPool[i].iter);
+            }
+        }
+        strcpy(brkPool[i].name, name);
+        brkPool[i].graphite = graphite;
+        brkPool[i].iter = NULL;
+    }
+
+    brkPool[i].localeStrNum = localeStrNum;
+    brk_pool_to_front(i);
+    return &brkPool[0];
+}
+
+static UBreakIterator*
+brk_pool_open(const char* locale, UErrorCode* status)
+{
+    /* a copy of one we already have is cheaper than opening it afresh */
+    int i;
+    for (i = 0; i < brkPoolCount; ++i)
+        if (brkPool[i].iter != NULL && !brkPool[i].graphite && strcmp(brkPool[i].name, locale) == 0)
+#if U_ICU_VERSION_MAJOR_NUM >= 69
+            return ubrk_clone(brkPool[i].iter, status);
+#else
+            return ubrk_safeClone(brkPool[i].iter, NULL, NULL, status);
+#endif
+    return ubrk_open(UBRK_LINE, locale, NULL, 0, status);
+}
 
 void
 linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
 {
     UErrorCode status = U_ZERO_ERROR;
-    char* locale = (char*)gettexstring(localeStrNum);
+    brkPoolEntry* entry = brk_pool_entry(localeStrNum);
 
-    if (fontarea[f] == OTGR_FONT_FLAG && strcmp(locale, "G") == 0) {
+    if (fontarea[f] == OTGR_FONT_FLAG && entry->graphite) {
         XeTeXLayoutEngine engine = (XeTeXLayoutEngine) fontlayoutengine[f];
-        if (initGraphiteBreaking(engine, text, textLength))
+        if (initGraphiteBreaking(engine, text, textLength)) {
             /* user asked for Graphite line breaking and the font supports it */
+            grBreakEngine = engine;
             return;
+        }
     }
+    grBreakEngine = NULL;
 
-    if ((localeStrNum != brkLocaleStrNum) && (brkIter != NULL)) {
-        ubrk_close(brkIter);
-        brkIter = NULL;
-    }
-
-    if (brkIter == NULL) {
-        brkIter = ubrk_open(UBRK_LINE, locale, NULL, 0, &status);
+    if (entry->iter == NULL) {
+        entry->iter = ubrk_open(UBRK_LINE, entry->name, NULL, 0, &status);
         if (U_FAILURE(status)) {
             begindiagnostic();
             printnl('E');
             printcstring("rror ");
             printint(status);
             printcstring(" creating linebreak iterator for locale `");
-            printcstring(locale);
+            printcstring(entry->name);
             printcstring("'; trying default locale `en_us'.");
             enddiagnostic(1);
-            if (brkIter != NULL)
-                ubrk_close(brkIter);
+            if (entry->iter != NULL)
+                ubrk_close(entry->iter);
             status = U_ZERO_ERROR;
-            brkIter = ubrk_open(UBRK_LINE, "en_us", NULL, 0, &status);
+            entry->iter = brk_pool_open("en_US", &status);
         }
-        free(locale);
-        brkLocaleStrNum = localeStrNum;
     }
+    brkIter = entry->iter;
 
     if (brkIter == NULL) {
         die("! failed to create linebreak iterator, status=%d", (int)status);
@@ -529,10 +1048,29 @@ linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength)
 int
 linebreaknext(void)
 {
-    if (brkIter != NULL)
-        return ubrk_next((UBreakIterator*)brkIter);
+    if (grBreakEngine != NULL)
+        return findNextGraphiteBreak(grBreakEngine);
     else
-        return findNextGraphiteBreak();
+        return ubrk_next((UBreakIterator*)brkIter);
+}
+
+/* One bit for each pair of character classes (prev_class * char_class_limit + class)
+   that may have \XeTeXinterchartoks, so that the main loop can skip the
+   sparse-array lookup for all other pairs; bits are only ever set. */
+#define INTER_CHAR_PAIRS    (0x1000 * 0x1000)
+
+unsigned char* intercharpairs = NULL;
+
+void
+setintercharpair(integer n)
+{
+    /* n < 0: any pair may have tokens (e.g. those loaded from a format) */
+    if (intercharpairs == NULL)
+        intercharpairs = (unsigned char*) xcalloc(INTER_CHAR_PAIRS / 8, 1);
+    if (n < 0)
+        memset(intercharpairs, 0xff, INTER_CHAR_PAIRS / 8);
+    else if (n < INTER_CHAR_PAIRS)
+        intercharpairs[n >> 3] |= 1 << (n & 7);
 }
 
 int
@@ -606,15 +1144,39 @@ printchars(const unsigned short* str, int len)
 #define UTF16_NATIVE kForm_UTF16LE
 #endif
 
-static void*
-load_mapping_file(const char* s, const char* e, char byteMapping)
+/* Compiled mappings are shared by all fonts that name them, as every use
+   of a converter resets it afterwards; fonts are never unloaded, so
+   neither are the mappings. */
+typedef struct mappingCacheEntry {
+    struct mappingCacheEntry*   next;
+    char*                       name;       /* file name, with ".tec" */
+    char                        byteMapping;
+    TECkit_Converter            cnv;
+    short*                      charMap;    /* for byte mappings: result per UTF-16 code unit,
+                                               -1 if not yet known; made on first use */
+} mappingCacheEntry;
+
+static mappingCacheEntry* mappingCache = NULL;
+
+static mappingCacheEntry*
+load_mapping_entry(const char* s, const char* e, char byteMapping)
 {
     char* mapPath;
     TECkit_Converter cnv = 0;
+    mappingCacheEntry* entry;
     char* buffer = (char*) xmalloc(e - s + 5);
     strncpy(buffer, s, e - s);
     buffer[e - s] = 0;
     strcat(buffer, ".tec");
+
+    for (entry = mappingCache; entry != NULL; entry = entry->next)
+        if (entry->byteMapping == byteMapping && strcmp(entry->name, buffer) == 0) {
+            if (gettracingfontsstate() > 1)
+                fontmappingwarning(buffer, strlen(buffer), 0); /* tracing */
+            free(buffer);
+            return entry;
+        }
+
     mapPath = kpse_find_file(buffer, kpse_miscfonts_format, 1);
 
     if (mapPath) {
@@ -650,9 +1212,27 @@ load_mapping_file(const char* s, const char* e, char byteMapping)
         fontmappingwarning(buffer, strlen(buffer), 1); /* not found */
     }
 
-    free(buffer);
+    if (cnv == NULL) {
+        free(buffer);
+        return NULL;
+    }
+
+    entry = (mappingCacheEntry*) xmalloc(sizeof(mappingCacheEntry));
+    entry->name = buffer;
+    entry->byteMapping = byteMapping;
+    entry->cnv = cnv;
+    entry->charMap = NULL;
+    entry->next = mappingCache;
+    mappingCache = entry;
 
-    return cnv;
+    return entry;
+}
+
+static void*
+load_mapping_file(const char* s, const char* e, char byteMapping)
+{
+    mappingCacheEntry* entry = load_mapping_entry(s, e, byteMapping);
+    return entry != NULL ? entry->cnv : NULL;
 }
 
 char *saved_mapping_name = NULL;
@@ -677,9 +1257,11 @@ checkfortfmfontmapping(void)
 void*
 loadtfmfontmapping(void)
 {
+    /* the result is only passed back to applytfmfontmapping, so it is the
+       cache entry rather than the converter itself */
     void* rval = NULL;
     if (saved_mapping_name != NULL) {
-        rval = load_mapping_file(saved_mapping_name,
+        rval = load_mapping_entry(saved_mapping_name,
                 saved_mapping_name + strlen(saved_mapping_name), 1);
         free(saved_mapping_name);
         saved_mapping_name = NULL;
@@ -688,19 +1270,26 @@ loadtfmfontmapping(void)
 }
 
 int
-applytfmfontmapping(void* cnv, int c)
+applytfmfontmapping(void* mapping, int c)
 {
+    mappingCacheEntry* entry = (mappingCacheEntry*)mapping;
     UniChar in = c;
     Byte out[2];
     UInt32 inUsed, outUsed;
+
+    if (entry->charMap == NULL) {
+        entry->charMap = (short*) xmalloc(0x10000 * sizeof(short));
+        memset(entry->charMap, 0xff, 0x10000 * sizeof(short));
+    }
+    if (entry->charMap[in] >= 0)
+        return entry->charMap[in];
+
     /* TECkit_Status status; */
-    /* status = */ TECkit_ConvertBuffer((TECkit_Converter)cnv,
+    /* status = */ TECkit_ConvertBuffer(entry->cnv,
             (const Byte*)&in, sizeof(in), &inUsed, out, sizeof(out), &outUsed, 1);
-    TECkit_ResetConverter((TECkit_Converter)cnv);
-    if (outUsed < 1)
-        return 0;
-    else
-        return out[0];
+    TECkit_ResetConverter(entry->cnv);
+    entry->charMap[in] = (outUsed < 1) ? 0 : out[0];
+    return entry->charMap[in];
 }
 
 double
@@ -1500,12 +2089,19 @@ grfontgetnamed1(integer what, void* pEngine, integer param)
     return rval;
 }
 
+#define XDV_FLAG_FONT_FILE      0x0010  /* in compact XDV files */
+#define XDV_FLAG_FONT_FILE_REF  0x0020
 #define XDV_FLAG_VERTICAL       0x0100
 #define XDV_FLAG_COLORED        0x0200
 #define XDV_FLAG_EXTEND         0x1000
 #define XDV_FLAG_SLANT          0x2000
 #define XDV_FLAG_EMBOLDEN       0x4000
 
+#define XDV_GLYPHS_NO_Y         0x01    /* in compact glyph arrays */
+
+#define XDV_SET_GLYPHS          253     /* as set_glyphs and set_text_and_glyphs in xetex.web */
+#define XDV_SET_TEXT_AND_GLYPHS 254
+
 #ifdef XETEX_MAC
 static UInt32
 cgColorToRGBA32(CGColorRef color)
@@ -1524,78 +2120,586 @@ cgColorToRGBA32(CGColorRef color)
 #endif
 
 static int xdvBufSize = 0;
+static int xdvOutputPeak = 0;   /* the most room any one command has needed */
 
-int
-makeXDVGlyphArrayData(void* pNode)
+static void
+note_output_size(int size)
 {
-    unsigned char* cp;
-    uint16_t* glyphIDs;
-    memoryword* p = (memoryword*) pNode;
-    void* glyph_info;
-    FixedPoint* locations;
-    Fixed width;
-    uint16_t glyphCount = native_glyph_count(p);
+    if (size > xdvOutputPeak)
+        xdvOutputPeak = size;
+}
 
-    int i = glyphCount * native_glyph_info_size + 8; /* to guarantee enough space in the buffer */
-    if (i > xdvBufSize) {
+static void
+ensure_xdv_buffer(int size)
+{
+    /* xdvbuffer is only scratch space, so its contents need not be kept;
+       it grows by doubling and is never shrunk, so after the first few long
+       words output runs without allocating */
+    note_output_size(size);
+    if (size > xdvBufSize) {
+        int newSize = (xdvBufSize == 0) ? 1024 : xdvBufSize;
+        while (newSize < size)
+            newSize *= 2;
         if (xdvbuffer != NULL)
             free(xdvbuffer);
-        xdvBufSize = ((i / 1024) + 1) * 1024;
+        xdvBufSize = newSize;
         xdvbuffer = (char*) xmalloc(xdvBufSize);
     }
+}
 
-    glyph_info = native_glyph_info_ptr(p);
-    locations = (FixedPoint*)glyph_info;
-    glyphIDs = (uint16_t*)(locations + glyphCount);
-
-    cp = (unsigned char*)xdvbuffer;
-
-    width = node_width(p);
-    *cp++ = (width >> 24) & 0xff;
-    *cp++ = (width >> 16) & 0xff;
-    *cp++ = (width >> 8) & 0xff;
-    *cp++ = width & 0xff;
+integer
+xdvoutputpeak(void)
+{
+    return xdvOutputPeak;
+}
 
-    *cp++ = (glyphCount >> 8) & 0xff;
-    *cp++ = glyphCount & 0xff;
+integer
+xdvbuffersize(void)
+{
+    return xdvBufSize;
+}
 
-    for (i = 0; i < glyphCount; ++i) {
-        Fixed x = locations[i].x;
-        Fixed y = locations[i].y;
-        *cp++ = (x >> 24) & 0xff;
-        *cp++ = (x >> 16) & 0xff;
-        *cp++ = (x >> 8) & 0xff;
-        *cp++ = x & 0xff;
-        *cp++ = (y >> 24) & 0xff;
-        *cp++ = (y >> 16) & 0xff;
-        *cp++ = (y >> 8) & 0xff;
-        *cp++ = y & 0xff;
+/* store n 32-bit values big-endian at out */
+static unsigned char*
+put_big_endian32(unsigned char* out, const uint32_t* in, int n)
+{
+    int i = 0;
+#if U_IS_BIG_ENDIAN
+    memcpy(out, in, n * sizeof(uint32_t));
+    return out + n * sizeof(uint32_t);
+#else
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));   /* swap bytes in each half */
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));            /* and then the halves */
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(out + 4 * i), v);
     }
-
-    for (i = 0; i < glyphCount; ++i) {
-        uint16_t g = glyphIDs[i];
-        *cp++ = (g >> 8) & 0xff;
-        *cp++ = g & 0xff;
+#endif
+    for (; i < n; ++i) {
+        uint32_t v = SWAP32(in[i]);
+        memcpy(out + 4 * i, &v, sizeof(v));
     }
+    return out + n * sizeof(uint32_t);
+#endif
+}
 
-    return ((char*)cp - xdvbuffer);
+/* store n 16-bit values big-endian at out */
+static unsigned char*
+put_big_endian16(unsigned char* out, const uint16_t* in, int n)
+{
+    int i = 0;
+#if U_IS_BIG_ENDIAN
+    memcpy(out, in, n * sizeof(uint16_t));
+    return out + n * sizeof(uint16_t);
+#else
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(out + 2 * i), v);
+    }
+#endif
+    for (; i < n; ++i) {
+        uint16_t v = SWAP16(in[i]);
+        memcpy(out + 2 * i, &v, sizeof(v));
+    }
+    return out + n * sizeof(uint16_t);
+#endif
 }
 
 int
-makefontdef(integer f)
+xdvcompact(void)
+{
+    /* whether to write the compact XDV variant; fixed for the whole run,
+       as the preamble announces it */
+    static int compact = -1;
+    if (compact < 0) {
+        char* v = kpse_var_value("xetex_compact_xdv");
+        compact = (v != NULL && (*v == '1' || *v == 'y' || *v == 't'));
+        free(v);
+    }
+    return compact;
+}
+
+static unsigned char*
+put_varint(unsigned char* cp, uint32_t v)
+{
+    while (v >= 0x80) {
+        *cp++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *cp++ = v;
+    return cp;
+}
+
+/* signed difference a - b folded so that small magnitudes give small varints */
+static uint32_t
+zigzag_delta(Fixed a, Fixed b)
+{
+    int32_t d = (int32_t)((uint32_t)a - (uint32_t)b);
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static unsigned char*
+put_compact_glyphs(unsigned char* cp, const FixedPoint* locations, const uint16_t* glyphIDs, int glyphCount)
+{
+    /* see |set_glyphs| in xetex.web for the layout */
+    Fixed prev;
+    int i, noY = 1;
+
+    for (i = 0; i < glyphCount; ++i)
+        if (locations[i].y != 0) {
+            noY = 0;
+            break;
+        }
+    *cp++ = noY ? XDV_GLYPHS_NO_Y : 0;
+
+    for (prev = 0, i = 0; i < glyphCount; ++i) {
+        cp = put_varint(cp, zigzag_delta(locations[i].x, prev));
+        prev = locations[i].x;
+    }
+    if (!noY)
+        for (prev = 0, i = 0; i < glyphCount; ++i) {
+            cp = put_varint(cp, zigzag_delta(locations[i].y, prev));
+            prev = locations[i].y;
+        }
+    for (i = 0; i < glyphCount; ++i)
+        cp = put_varint(cp, glyphIDs[i]);
+
+    return cp;
+}
+
+static unsigned char*
+put_glyph_array(unsigned char* cp, memoryword* p)
+{
+    /* the set_glyphs data of a native word: width, glyph count, then the
+       locations and glyph IDs; compact records take up to 5+5+3 bytes per
+       glyph, plus a flag byte */
+    uint16_t glyphCount = native_glyph_count(p);
+    FixedPoint* locations = (FixedPoint*)native_glyph_info_ptr(p);
+    uint16_t* glyphIDs = (uint16_t*)(locations + glyphCount);
+    Fixed width = node_width(p);
+
+    *cp++ = (width >> 24) & 0xff;
+    *cp++ = (width >> 16) & 0xff;
+    *cp++ = (width >> 8) & 0xff;
+    *cp++ = width & 0xff;
+
+    *cp++ = (glyphCount >> 8) & 0xff;
+    *cp++ = glyphCount & 0xff;
+
+    if (xdvcompact())
+        return put_compact_glyphs(cp, locations, glyphIDs, glyphCount);
+
+    /* the x and y of each location, in that order */
+    cp = put_big_endian32(cp, (const uint32_t*)locations, 2 * glyphCount);
+    return put_big_endian16(cp, glyphIDs, glyphCount);
+}
+
+static unsigned char*
+put_native_text(unsigned char* cp, memoryword* p)
+{
+    /* the text of a native word as set_text_and_glyphs has it: length, then UTF-16 */
+    uint16_t len = native_length(p);
+
+    *cp++ = (len >> 8) & 0xff;
+    *cp++ = len & 0xff;
+    return put_big_endian16(cp, (const uint16_t*)(p + native_node_size), len);
+}
+
+/* like dvi_out for each byte, but copying as much as fits in the current half of dvi_buf at once */
+static void
+dvi_out_bytes(const unsigned char* bytes, int len)
+{
+    while (len > 0) {
+        int n = dvilimit - dviptr;
+        if (n > len)
+            n = len;
+        memcpy(&dvibuf[dviptr], bytes, n);
+        dviptr += n;
+        bytes += n;
+        len -= n;
+        if (dviptr == dvilimit)
+            dviswap();
+    }
+}
+
+void
+dvioutxdvbuffer(integer len)
+{
+    dvi_out_bytes((const unsigned char*)xdvbuffer, len);
+}
+
+void
+dvioutpool(integer start, integer end)
+{
+    /* str_pool[start..end) as bytes, as dvi_out(so(str_pool[k])) would write them */
+    while (start < end) {
+        int n = dvilimit - dviptr;
+        int i;
+        if (n > end - start)
+            n = end - start;
+        for (i = 0; i < n; ++i)
+            dvibuf[dviptr + i] = strpool[start + i];
+        dviptr += n;
+        start += n;
+        if (dviptr == dvilimit)
+            dviswap();
+    }
+}
+
+void
+dvioutglyph(integer width, integer glyph)
+{
+    /* set_glyphs data for a single glyph at the origin, as for glyph_node */
+    FixedPoint origin = { 0, 0 };
+    uint16_t g = glyph;
+    unsigned char* cp;
+
+    ensure_xdv_buffer(6 + native_glyph_info_size + 3);
+    cp = (unsigned char*)xdvbuffer;
+
+    *cp++ = (width >> 24) & 0xff;
+    *cp++ = (width >> 16) & 0xff;
+    *cp++ = (width >> 8) & 0xff;
+    *cp++ = width & 0xff;
+
+    *cp++ = 0;
+    *cp++ = 1;
+
+    if (xdvcompact())
+        cp = put_compact_glyphs(cp, &origin, &g, 1);
+    else {
+        cp = put_big_endian32(cp, (const uint32_t*)&origin, 2);
+        cp = put_big_endian16(cp, &g, 1);
+    }
+
+    dvi_out_bytes((const unsigned char*)xdvbuffer, (char*)cp - xdvbuffer);
+}
+
+void
+dviOutNativeWord(void* pNode, int withText)
+{
+    /* set_glyphs for a native word, or set_text_and_glyphs when it carries
+       ActualText; the whole command is serialized in one pass, straight
+       into dvi_buf when it fits in the current half */
+    memoryword* p = (memoryword*) pNode;
+    int size = 1 + 7 + native_glyph_count(p) * (native_glyph_info_size + 3);
+    unsigned char* start;
+    unsigned char* cp;
+
+    if (withText)
+        size += 2 + 2 * native_length(p);
+    if (dvilimit - dviptr >= size) {
+        note_output_size(size);
+        start = (unsigned char*)&dvibuf[dviptr];
+    } else {
+        ensure_xdv_buffer(size);
+        start = (unsigned char*)xdvbuffer;
+    }
+
+    cp = start;
+    *cp++ = withText ? XDV_SET_TEXT_AND_GLYPHS : XDV_SET_GLYPHS;
+    if (withText)
+        cp = put_native_text(cp, p);
+    cp = put_glyph_array(cp, p);
+
+    if (start == (unsigned char*)xdvbuffer)
+        dvi_out_bytes(start, cp - start);
+    else {
+        dviptr += cp - start;
+        if (dviptr == dvilimit)
+            dviswap();
+    }
+}
+
+/* Reusing boxes as forms (see |box_form| in xetex.web): the WEB code feeds
+   the contents of a candidate box into two independent hashes, and
+   boxhashform looks the box up among those shipped out before. A box only
+   matches one with the same hashes, number of nodes and dimensions. */
+typedef struct {
+    uint64_t    hash;           /* 0 marks an empty slot */
+    uint64_t    check;
+    integer     nodes;
+    integer     width, height, depth;
+    int         form;           /* 0 if seen only once so far */
+} boxFormEntry;
+
+static uint64_t boxHash;
+static uint64_t boxCheck;
+static boxFormEntry* boxForms = NULL;
+static int boxFormsSize = 0;    /* a power of two */
+static int boxFormsUsed = 0;
+static int boxFormCount = 0;
+static int formDepth = 0;       /* forms being captured; they can't nest */
+
+/* the colours set by color specials, innermost last, each as a hash of
+   its specification; the driver starts each form in the current colour */
+static uint64_t* formColors = NULL;
+static int formColorDepth = 0;
+static int formColorsSize = 0;
+
+int
+reuseboxes(void)
+{
+    static int reuse = -1;
+    if (reuse < 0) {
+        char* v = kpse_var_value("xetex_reuse_boxes");
+        reuse = (v != NULL && (*v == '1' || *v == 'y' || *v == 't'));
+        free(v);
+    }
+    return reuse;
+}
+
+void
+boxhashbegin(void)
+{
+    boxHash = 0x9E3779B97F4A7C15ULL;
+    boxCheck = 0x243F6A8885A308D3ULL;
+}
+
+void
+boxhashadd(integer v)
+{
+    boxHash ^= (uint32_t)v * 0x9E3779B97F4A7C15ULL;
+    boxHash = ((boxHash << 31) | (boxHash >> 33)) * 0xC2B2AE3D27D4EB4FULL;
+    /* an FNV-1a style hash over the four bytes, which mixes quite differently */
+    boxCheck = (boxCheck ^ ((uint32_t)v & 0xff)) * 0x100000001B3ULL;
+    boxCheck = (boxCheck ^ (((uint32_t)v >> 8) & 0xff)) * 0x100000001B3ULL;
+    boxCheck = (boxCheck ^ (((uint32_t)v >> 16) & 0xff)) * 0x100000001B3ULL;
+    boxCheck = (boxCheck ^ ((uint32_t)v >> 24)) * 0x100000001B3ULL;
+}
+
+void
+boxhashaddreal(double r)
+{
+    uint64_t bits;
+    memcpy(&bits, &r, sizeof(bits));
+    boxhashadd((integer)(bits >> 32));
+    boxhashadd((integer)bits);
+}
+
+void
+boxHashAddNative(void* pNode)
+{
+    memoryword* p = (memoryword*) pNode;
+    int count = native_glyph_count(p);
+    int len = native_length(p);
+    const uint16_t* text = (const uint16_t*)(p + native_node_size);
+    const FixedPoint* locations = (const FixedPoint*)native_glyph_info_ptr(p);
+    const uint16_t* glyphIDs = (const uint16_t*)(locations + count);
+    int i;
+
+    boxhashadd(native_font(p));
+    boxhashadd(node_width(p));
+    boxhashadd(node_depth(p));
+    boxhashadd(node_height(p));
+    boxhashadd(len);
+    for (i = 0; i < len; ++i)
+        boxhashadd(text[i]);
+    boxhashadd(count);
+    for (i = 0; i < count; ++i) {
+        boxhashadd(locations[i].x);
+        boxhashadd(locations[i].y);
+        boxhashadd(glyphIDs[i]);
+    }
+}
+
+static int
+same_box(const boxFormEntry* e, uint64_t h, integer nodes, integer width, integer height, integer depth)
+{
+    return e->hash == h && e->check == boxCheck && e->nodes == nodes
+        && e->width == width && e->height == height && e->depth == depth;
+}
+
+integer
+boxhashform(integer nodes, integer width, integer height, integer depth)
+{
+    uint64_t h;
+    int i;
+
+    if (formColorDepth > 0) {
+        boxhashadd((integer)(formColors[formColorDepth - 1] >> 32));
+        boxhashadd((integer)formColors[formColorDepth - 1]);
+    }
+    h = boxHash ^ (boxHash >> 29);
+
+    if (boxFormsUsed * 2 >= boxFormsSize) {
+        boxFormEntry* old = boxForms;
+        int oldSize = boxFormsSize;
+        boxFormsSize = (oldSize == 0) ? 1024 : 2 * oldSize;
+        boxForms = (boxFormEntry*) xcalloc(boxFormsSize, sizeof(boxFormEntry));
+        for (i = 0; i < oldSize; ++i)
+            if (old[i].hash != 0) {
+                int j = old[i].hash & (boxFormsSize - 1);
+                while (boxForms[j].hash != 0)
+                    j = (j + 1) & (boxFormsSize - 1);
+                boxForms[j] = old[i];
+            }
+        free(old);
+    }
+
+    if (h == 0)
+        h = 1; /* 0 marks an empty slot */
+    for (i = h & (boxFormsSize - 1); boxForms[i].hash != 0; i = (i + 1) & (boxFormsSize - 1))
+        if (same_box(&boxForms[i], h, nodes, width, height, depth)) {
+            if (boxForms[i].form > 0)
+                return boxForms[i].form;
+            if (formDepth > 0)
+                return 0;
+            boxForms[i].form = ++boxFormCount;
+            return -boxForms[i].form;
+        }
+
+    boxForms[i].hash = h;
+    boxForms[i].check = boxCheck;
+    boxForms[i].nodes = nodes;
+    boxForms[i].width = width;
+    boxForms[i].height = height;
+    boxForms[i].depth = depth;
+    boxForms[i].form = 0;
+    boxFormsUsed++;
+    return 0;
+}
+
+static int
+special_starts_with(const unsigned char* s, int len, const char* prefix)
+{
+    int n = strlen(prefix);
+    return len >= n && memcmp(s, prefix, n) == 0
+        && (len == n || s[n] == ' ' || s[n] == '\t');
+}
+
+void
+noteformspecial(integer start, integer end)
+{
+    /* keep track of the colour stack of the driver, from the specials
+       in str_pool[start..end) */
+    const unsigned char* s = (const unsigned char*)&strpool[start];
+    int len = end - start;
+
+    while (len > 0 && (*s == ' ' || *s == '\t')) {
+        s++;
+        len--;
+    }
+    if (special_starts_with(s, len, "color push") || special_starts_with(s, len, "pdf:bcolor")
+            || special_starts_with(s, len, "pdf:bc")) {
+        uint64_t h = 0xCBF29CE484222325ULL;
+        int i;
+        for (i = 0; i < len; ++i)
+            h = (h ^ s[i]) * 0x100000001B3ULL;
+        if (formColorDepth == formColorsSize) {
+            formColorsSize = (formColorsSize == 0) ? 16 : 2 * formColorsSize;
+            formColors = (uint64_t*) xrealloc(formColors, formColorsSize * sizeof(uint64_t));
+        }
+        formColors[formColorDepth++] = h;
+    } else if (special_starts_with(s, len, "color pop") || special_starts_with(s, len, "pdf:ecolor")
+            || special_starts_with(s, len, "pdf:ec")) {
+        if (formColorDepth > 0)
+            formColorDepth--;
+    }
+}
+
+static void
+forget_box_forms(void)
+{
+    /* a new XDV segment is processed on its own, so the forms captured in
+       earlier segments must be captured again */
+    int i;
+    for (i = 0; i < boxFormsSize; ++i)
+        boxForms[i].form = 0;
+}
+
+int
+makeformspecial(int kind, integer n, integer minH, integer minV, integer maxH, integer maxV)
+{
+    /* the text of the pdf:bxobj, pdf:exobj or pdf:uxobj special for form n;
+       kind is begin_form, end_form or use_form. For pdf:bxobj, the area the
+       box covers is given in sp relative to its reference point, with v
+       going down; the bounding box adds a margin of an inch to it, for
+       glyphs that stick out of their character boxes. */
+    const double bp = 72.0 / 72.27 / 65536.0;
+    ensure_xdv_buffer(128);
+    switch (kind) {
+        case 0:
+            formDepth++;
+            return sprintf(xdvbuffer, "pdf:bxobj @xetexbox%d bbox %.0f %.0f %.0f %.0f", (int) n,
+                           floor(minH * bp) - 72, floor(-maxV * bp) - 72,
+                           ceil(maxH * bp) + 72, ceil(-minV * bp) + 72);
+        case 1:
+            formDepth--;
+            return sprintf(xdvbuffer, "pdf:exobj");
+        default:
+            return sprintf(xdvbuffer, "pdf:uxobj @xetexbox%d", (int) n);
+    }
+}
+
+/* Native font definitions are built once per font, as each is written
+   twice (on first use and in the postamble). The font file is kept apart
+   from the rest so that compact XDV files can name each file only once. */
+typedef struct {
+    char*       name;
+    uint32_t    index;
+    int         declaredIn;         /* section in which it was last written in full */
+} fontFileEntry;
+
+typedef struct {
+    unsigned char*  data;           /* size[4] flags[2], then the optional fields */
+    int             length;
+    int             file;           /* index into fontFiles; -1 if not built yet */
+} fontDefEntry;
+
+static fontFileEntry* fontFiles = NULL;
+static int fontFileCount = 0;
+static int fontFilesSize = 0;
+static fontDefEntry* fontDefs = NULL;
+static int fontDefsSize = 0;
+static int fontDefSection = 1;      /* the pages, then the postamble */
+
+void
+beginxdvpostamble(void)
+{
+    /* the postamble repeats all font definitions, so it must name each
+       font file in full again */
+    fontDefSection++;
+}
+
+static int
+font_file_number(char* filename, uint32_t index)
+{
+    /* takes over filename */
+    int i;
+    for (i = 0; i < fontFileCount; ++i)
+        if (fontFiles[i].index == index && strcmp(fontFiles[i].name, filename) == 0) {
+            free(filename);
+            return i;
+        }
+    if (fontFileCount == fontFilesSize) {
+        fontFilesSize = (fontFilesSize == 0) ? 16 : 2 * fontFilesSize;
+        fontFiles = (fontFileEntry*) xrealloc(fontFiles, fontFilesSize * sizeof(fontFileEntry));
+    }
+    fontFiles[fontFileCount].name = filename;
+    fontFiles[fontFileCount].index = index;
+    fontFiles[fontFileCount].declaredIn = 0;
+    return fontFileCount++;
+}
+
+static fontDefEntry*
+build_font_def(integer f)
 {
     uint16_t flags = 0;
     uint32_t rgba;
     Fixed size;
     char* filename;
     uint32_t index;
-    uint8_t filenameLen;
-    int fontDefLength;
-    char* cp;
+    unsigned char* cp;
     /* PlatformFontRef fontRef = 0; */
     float extend = 1.0;
     float slant = 0.0;
     float embolden = 0.0;
+    fontDefEntry* def;
 
 #ifdef XETEX_MAC
     CFDictionaryRef attributes = NULL;
@@ -1654,48 +2758,51 @@ makefontdef(integer f)
         exit(3);
     }
 
-    filenameLen = strlen(filename);
+    if (f >= fontDefsSize) {
+        int i, newSize = (f < 2 * fontDefsSize) ? 2 * fontDefsSize : f + 64;
+        fontDefs = (fontDefEntry*) xrealloc(fontDefs, newSize * sizeof(fontDefEntry));
+        for (i = fontDefsSize; i < newSize; ++i) {
+            fontDefs[i].data = NULL;
+            fontDefs[i].file = -1;
+        }
+        fontDefsSize = newSize;
+    }
+    def = &fontDefs[f];
 
     /* parameters after internal font ID:
     //  size[4]
     //  flags[2]
     //  l[1] n[l]
+    //  i[4]
     //  if flags & COLORED:
     //      c[4]
+    //  if flags & EXTEND, SLANT, EMBOLDEN:
+    //      the factor[4]
+    // here we keep all but the file name and face index
     */
 
-    fontDefLength
-        = 4 /* size */
-        + 2 /* flags */
-        + 1 /* name length */
-        + filenameLen
-        + 4 /* face index */;
+    def->length = 4 /* size */ + 2 /* flags */;
 
     if ((fontflags[f] & FONT_FLAGS_COLORED) != 0) {
-        fontDefLength += 4; /* 32-bit RGBA value */
+        def->length += 4; /* 32-bit RGBA value */
         flags |= XDV_FLAG_COLORED;
     }
 
     if (extend != 1.0) {
-        fontDefLength += 4;
+        def->length += 4;
         flags |= XDV_FLAG_EXTEND;
     }
     if (slant != 0.0) {
-        fontDefLength += 4;
+        def->length += 4;
         flags |= XDV_FLAG_SLANT;
     }
     if (embolden != 0.0) {
-        fontDefLength += 4;
+        def->length += 4;
         flags |= XDV_FLAG_EMBOLDEN;
     }
 
-    if (fontDefLength > xdvBufSize) {
-        if (xdvbuffer != NULL)
-            free(xdvbuffer);
-        xdvBufSize = ((fontDefLength / 1024) + 1) * 1024;
-        xdvbuffer = (char*) xmalloc(xdvBufSize);
-    }
-    cp = xdvbuffer;
+    def->data = (unsigned char*) xmalloc(def->length);
+    cp = def->data;
 
     *(Fixed*)cp = SWAP32(size);
     cp += 4;
@@ -1703,14 +2810,6 @@ makefontdef(integer f)
     *(uint16_t*)cp = SWAP16(flags);
     cp += 2;
 
-    *(uint8_t*)cp = filenameLen;
-    cp += 1;
-    memcpy(cp, filename, filenameLen);
-    cp += filenameLen;
-
-    *(uint32_t*)cp = SWAP32(index);
-    cp += 4;
-
     if ((fontflags[f] & FONT_FLAGS_COLORED) != 0) {
         *(uint32_t*)cp = SWAP32(rgba);
         cp += 4;
@@ -1732,11 +2831,102 @@ makefontdef(integer f)
         cp += 4;
     }
 
-    free((char*) filename);
+    def->file = font_file_number(filename, index);
+
+    return def;
+}
+
+int
+makefontdef(integer f)
+{
+    fontDefEntry* def;
+    fontFileEntry* file;
+    uint16_t flags;
+    uint8_t filenameLen;
+    int fontDefLength;
+    int fullName = 1;
+    unsigned char* cp;
+
+    if (f < fontDefsSize && fontDefs[f].file >= 0)
+        def = &fontDefs[f];
+    else
+        def = build_font_def(f);
+    file = &fontFiles[def->file];
+
+    flags = (def->data[4] << 8) | def->data[5];
+    if (xdvcompact()) {
+        if (file->declaredIn == fontDefSection) {
+            flags |= XDV_FLAG_FONT_FILE_REF;
+            fullName = 0;
+        } else {
+            flags |= XDV_FLAG_FONT_FILE;
+            file->declaredIn = fontDefSection;
+        }
+    }
+
+    filenameLen = strlen(file->name);
+    fontDefLength = def->length
+        + (xdvcompact() ? 2 : 0) /* file number */
+        + (fullName ? 1 + filenameLen + 4 : 0); /* name length, name, face index */
+
+    ensure_xdv_buffer(fontDefLength);
+    cp = (unsigned char*)xdvbuffer;
+
+    memcpy(cp, def->data, 4); /* size */
+    cp += 4;
+
+    *cp++ = (flags >> 8) & 0xff;
+    *cp++ = flags & 0xff;
+
+    if (xdvcompact()) {
+        *cp++ = (def->file >> 8) & 0xff;
+        *cp++ = def->file & 0xff;
+    }
+
+    if (fullName) {
+        *cp++ = filenameLen;
+        memcpy(cp, file->name, filenameLen);
+        cp += filenameLen;
+
+        *(uint32_t*)cp = SWAP32(file->index);
+        cp += 4;
+    }
+
+    memcpy(cp, def->data + 6, def->length - 6);
 
     return fontDefLength;
 }
 
+/* Results of applymapping for short texts are remembered, as the same
+   words are mapped over and over; the converters are reset after each
+   use, so the result depends only on the converter and the text. */
+#define MAPPING_MEMO_SIZE       1024    /* slots; a power of two */
+#define MAPPING_MEMO_MAX_LEN    32      /* longest text remembered, in UTF-16 units */
+
+typedef struct {
+    void*   cnv;
+    int     inLen;
+    int     outLen;
+    UniChar in[MAPPING_MEMO_MAX_LEN];
+    UniChar out[2 * MAPPING_MEMO_MAX_LEN];
+} mappingMemoSlot;
+
+static mappingMemoSlot* mappingMemo = NULL;
+
+static mappingMemoSlot*
+mapping_memo_slot(void* cnv, const uint16_t* txtPtr, int txtLen)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)cnv;
+    int i;
+
+    if (mappingMemo == NULL)
+        mappingMemo = (mappingMemoSlot*) xcalloc(MAPPING_MEMO_SIZE, sizeof(mappingMemoSlot));
+
+    for (i = 0; i < txtLen; ++i)
+        h = (h ^ txtPtr[i]) * 16777619u;
+    return &mappingMemo[h & (MAPPING_MEMO_SIZE - 1)];
+}
+
 int
 applymapping(void* pCnv, uint16_t* txtPtr, int txtLen)
 {
@@ -1744,15 +2934,28 @@ applymapping(void* pCnv, uint16_t* txtPtr, int txtLen)
     UInt32 inUsed, outUsed;
     TECkit_Status status;
     static UInt32 outLength = 0;
+    mappingMemoSlot* slot = NULL;
 
-    /* allocate outBuffer if not big enough */
+    /* allocate outBuffer if not big enough, growing it geometrically */
     if (outLength < txtLen * sizeof(UniChar) + 32) {
         if (mappedtext != 0)
             free(mappedtext);
-        outLength = txtLen * sizeof(UniChar) + 32;
+        outLength *= 2;
+        if (outLength < txtLen * sizeof(UniChar) + 32)
+            outLength = txtLen * sizeof(UniChar) + 32;
         mappedtext = xmalloc(outLength);
     }
 
+    if (txtLen <= MAPPING_MEMO_MAX_LEN) {
+        slot = mapping_memo_slot(pCnv, txtPtr, txtLen);
+        if (slot->cnv == pCnv && slot->inLen == txtLen
+                && memcmp(slot->in, txtPtr, txtLen * sizeof(UniChar)) == 0
+                && slot->outLen * sizeof(UniChar) <= outLength) {
+            memcpy(mappedtext, slot->out, slot->outLen * sizeof(UniChar));
+            return slot->outLen;
+        }
+    }
+
     /* try the mapping */
 retry:
     status = TECkit_ConvertBuffer(cnv,
@@ -1762,11 +2965,18 @@ retry:
 
     switch (status) {
         case kStatus_NoError:
+            if (slot != NULL && outUsed <= sizeof(slot->out)) {
+                slot->cnv = pCnv;
+                slot->inLen = txtLen;
+                slot->outLen = outUsed / sizeof(UniChar);
+                memcpy(slot->in, txtPtr, txtLen * sizeof(UniChar));
+                memcpy(slot->out, mappedtext, outUsed);
+            }
             txtPtr = (UniChar*)mappedtext;
             return outUsed / sizeof(UniChar);
 
         case kStatus_OutputBufferFull:
-            outLength += (txtLen * sizeof(UniChar)) + 32;
+            outLength *= 2;
             free(mappedtext);
             mappedtext = xmalloc(outLength);
             goto retry;
@@ -1988,8 +3198,41 @@ store_justified_native_glyphs(void* pNode)
     }
 }
 
+static void
+measure_native_node_or_piece(void* pNode, int pieceOffset, int use_glyph_metrics);
+
 void
 measure_native_node(void* pNode, int use_glyph_metrics)
+{
+    measure_native_node_or_piece(pNode, -1, use_glyph_metrics);
+}
+
+void
+setnativepiecetext(int f, uint16_t* text, integer textLength)
+{
+    /* remember text that is about to be cut into pieces (by hyphenation or
+       at locale line breaks), so that measure_native_piece can reuse its shaping */
+    if (fontarea[f] == OTGR_FONT_FLAG)
+        setPieceWord((XeTeXLayoutEngine)(fontlayoutengine[f]), text, textLength);
+}
+
+void
+set_native_piece_word(void* pNode)
+{
+    memoryword* node = (memoryword*)pNode;
+    setnativepiecetext(native_font(node), (uint16_t*)(node + native_node_size), native_length(node));
+}
+
+void
+measure_native_piece(void* pNode, integer offset, int use_glyph_metrics)
+{
+    /* as measure_native_node, for a node whose text is found at offset
+       in the text last given to setnativepiecetext */
+    measure_native_node_or_piece(pNode, offset, use_glyph_metrics);
+}
+
+static void
+measure_native_node_or_piece(void* pNode, int pieceOffset, int use_glyph_metrics)
 {
     memoryword* node = (memoryword*)pNode;
     int txtLen = native_length(node);
@@ -2086,38 +3329,34 @@ measure_native_node(void* pNode, int use_glyph_metrics)
             native_glyph_info_ptr(node) = glyph_info;
         } else {
             double width = 0;
-            totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
-
-            glyphs = (uint32_t*) xcalloc(totalGlyphCount, sizeof(uint32_t));
-            positions = (FloatPoint*) xcalloc(totalGlyphCount + 1, sizeof(FloatPoint));
-            advances = (float*) xcalloc(totalGlyphCount, sizeof(float));
-
-            getGlyphs(engine, glyphs);
-            getGlyphAdvances(engine, advances);
-            getGlyphPositions(engine, positions);
+            totalGlyphCount = -1;
+            if (pieceOffset >= 0)
+                totalGlyphCount = layoutPiece(engine, txtPtr, pieceOffset, txtLen, (dir == UBIDI_RTL));
+            if (totalGlyphCount < 0)
+                totalGlyphCount = layoutChars(engine, txtPtr, 0, txtLen, txtLen, (dir == UBIDI_RTL));
 
             if (totalGlyphCount > 0) {
                 int i;
+                Fixed fixedWidth;
                 glyph_info = xcalloc(totalGlyphCount, native_glyph_info_size);
                 locations = (FixedPoint*)glyph_info;
                 glyphIDs = (uint16_t*)(locations + totalGlyphCount);
                 glyphAdvances = (Fixed*) xcalloc(totalGlyphCount, sizeof(Fixed));
-                for (i = 0; i < totalGlyphCount; ++i) {
+
+                glyphs = (uint32_t*) xcalloc(totalGlyphCount, sizeof(uint32_t));
+                getGlyphs(engine, glyphs);
+                for (i = 0; i < totalGlyphCount; ++i)
                     glyphIDs[i] = glyphs[i];
-                    glyphAdvances[i] = D2Fix(advances[i]);
-                    locations[i].x = D2Fix(positions[i].x);
-                    locations[i].y = D2Fix(positions[i].y);
-                }
-                width = positions[totalGlyphCount].x;
-            }
+                free(glyphs);
+
+                /* converted straight to Fixed, several glyphs at a time where possible */
+                getGlyphFixedPositions(engine, locations, glyphAdvances, &fixedWidth);
+                node_width(node) = fixedWidth;
+            } else
+                node_width(node) = D2Fix(width);
 
-            node_width(node) = D2Fix(width);
             native_glyph_count(node) = totalGlyphCount;
             native_glyph_info_ptr(node) = glyph_info;
-
-            free(glyphs);
-            free(positions);
-            free(advances);
         }
 
         ubidi_close(pBiDi);
@@ -2187,6 +3426,132 @@ measure_native_node(void* pNode, int use_glyph_metrics)
     }
 }
 
+/* width of a piece of text in font f, measured via a scratch native_word node */
+static Fixed
+measure_native_text(int f, const uint16_t* txt, int len)
+{
+    static memoryword* node = NULL;
+    static int nodeSize = 0;
+    int size = native_node_size + (len * sizeof(uint16_t) + sizeof(memoryword) - 1) / sizeof(memoryword);
+    Fixed width;
+
+    if (size > nodeSize) {
+        free(node);
+        nodeSize = size + 16;
+        node = (memoryword*) xcalloc(nodeSize, sizeof(memoryword));
+    }
+
+    native_font(node) = f;
+    native_length(node) = len;
+    native_glyph_count(node) = 0;
+    native_glyph_info_ptr(node) = NULL;
+    memcpy(node + native_node_size, txt, len * sizeof(uint16_t));
+
+    measure_native_node(node, 0);
+    width = node_width(node);
+
+    free(native_glyph_info_ptr(node));
+    native_glyph_info_ptr(node) = NULL;
+
+    return width;
+}
+
+#define MAX_SPACE_CLUSTER   16  /* longest cluster (in UTF-16 units) we'll use as a cache key */
+
+/* true if the character continues the grapheme cluster before it */
+static int
+extends_cluster(UChar32 c)
+{
+    switch (u_getIntPropertyValue(c, UCHAR_GRAPHEME_CLUSTER_BREAK)) {
+    case U_GCB_EXTEND:
+    case U_GCB_SPACING_MARK:
+    case U_GCB_ZWJ:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* length of the grapheme cluster that ends the text */
+static int
+last_cluster_length(const uint16_t* txt, int len)
+{
+    int i = len;
+    while (i > 0) {
+        UChar32 c;
+        U16_PREV(txt, 0, i, c);
+        if (!extends_cluster(c))
+            break;
+    }
+    return len - i;
+}
+
+/* length of the grapheme cluster that begins the text */
+static int
+first_cluster_length(const uint16_t* txt, int len)
+{
+    int i = 0;
+    UChar32 c;
+    U16_NEXT(txt, i, len, c);
+    while (i < len) {
+        int j = i;
+        U16_NEXT(txt, j, len, c);
+        if (!extends_cluster(c))
+            break;
+        i = j;
+    }
+    return i;
+}
+
+Fixed
+get_native_interword_space(void* pNode1, void* pNode2)
+{
+    /* The contextual space between two words in the same font is the width of
+       "word1 word2" less the widths of the two words on their own. Only the
+       clusters that meet at the space can interact across it, so we measure just
+       those, and cache the result for the font and that pair of clusters. */
+    memoryword* node1 = (memoryword*)pNode1;
+    memoryword* node2 = (memoryword*)pNode2;
+    const uint16_t* txt1 = (const uint16_t*)(node1 + native_node_size);
+    const uint16_t* txt2 = (const uint16_t*)(node2 + native_node_size);
+    int len1 = native_length(node1);
+    int len2 = native_length(node2);
+    unsigned f = native_font(node1);
+    uint16_t key[2 * MAX_SPACE_CLUSTER + 1];
+    int c1, c2;
+    Fixed space;
+
+    if (len1 == 0 || len2 == 0)
+        return 0;
+
+    c1 = last_cluster_length(txt1, len1);
+    c2 = first_cluster_length(txt2, len2);
+
+    if (c1 == 0 || c1 > MAX_SPACE_CLUSTER || c2 > MAX_SPACE_CLUSTER) {
+        /* unusual clusters: measure the whole words, as we can't key on them */
+        uint16_t* txt = (uint16_t*) xmalloc((len1 + 1 + len2) * sizeof(uint16_t));
+        memcpy(txt, txt1, len1 * sizeof(uint16_t));
+        txt[len1] = ' ';
+        memcpy(txt + len1 + 1, txt2, len2 * sizeof(uint16_t));
+        space = measure_native_text(f, txt, len1 + 1 + len2) - node_width(node1) - node_width(node2);
+        free(txt);
+        return space;
+    }
+
+    memcpy(key, txt1 + len1 - c1, c1 * sizeof(uint16_t));
+    key[c1] = ' ';
+    memcpy(key + c1 + 1, txt2, c2 * sizeof(uint16_t));
+
+    if (getCachedInterwordSpace(f, key, c1 + 1 + c2, &space) == 0) {
+        space = measure_native_text(f, key, c1 + 1 + c2)
+              - measure_native_text(f, key, c1)
+              - measure_native_text(f, key + c1 + 1, c2);
+        cacheInterwordSpace(f, key, c1 + 1 + c2, space);
+    }
+
+    return space;
+}
+
 Fixed
 get_native_italic_correction(void* pNode)
 {
@@ -2626,6 +3991,7 @@ void
 u_close_inout(unicodefile* f)
 {
     if (f != 0) {
+        release_input_block(*f);
         fclose((*f)->f);
         if (((*f)->encodingMode == ICUMAPPING) && ((*f)->conversionData != NULL))
             ucnv_close((*f)->conversionData);
@@ -2641,8 +4007,355 @@ Isspace(char c)
 }
 #endif
 
-int
-open_dvi_output(FILE** fptr)
+/* dvi_buf is written out half at a time, and web2c limits dvi_buf_size to
+   64K, so the XDV data go through a further buffer of xetex_output_buffer
+   megabytes (from texmf.cnf or the environment; default 4, 0 for none) */
+static long
+output_buffer_megs(void)
+{
+    char* v = kpse_var_value("xetex_output_buffer");
+    long megs = 4;
+
+    if (v != NULL) {
+        megs = atol(v);
+        free(v);
+    }
+    if (megs < 0)
+        megs = 0;
+    if (megs > 1024)
+        megs = 1024;
+    return megs;
+}
+
+#ifdef XETEX_OUTPUT_QUEUE
+/* The output queue: the FILE that TeX writes the XDV data to only copies
+   them into a ring of chunks, and a writer thread passes full chunks on to
+   the driver pipe (or the output file), so that typesetting carries on while
+   xdvipdfmx is busy. */
+
+#define OUTPUT_QUEUE_CHUNKS 8
+
+typedef struct {
+    FILE*           out;            /* the driver pipe or output file */
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    char*           chunk[OUTPUT_QUEUE_CHUNKS];
+    size_t          used[OUTPUT_QUEUE_CHUNKS];
+    size_t          chunkSize;
+    int             head;           /* oldest chunk waiting to be written */
+    int             count;          /* chunks waiting, including the one being written;
+                                       chunk[(head + count) % N] is being filled */
+    int             closing;
+    int             error;          /* errno of the first failed write */
+    double          waitTime;       /* seconds the typesetter waited for a free chunk */
+    double          writeTime;      /* seconds the writer spent in fwrite() */
+} outputQueue;
+
+static outputQueue* dviQueue = NULL;
+
+static double
+monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+output_queue_writer(void* arg)
+{
+    outputQueue* q = (outputQueue*) arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        int i, err = 0;
+        double t;
+        while (q->count == 0 && !q->closing)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (q->count == 0)
+            break;
+        i = q->head;
+        pthread_mutex_unlock(&q->lock);
+
+        t = monotonic_seconds();
+        if (fwrite(q->chunk[i], 1, q->used[i], q->out) != q->used[i] || fflush(q->out) != 0)
+            err = errno;
+        t = monotonic_seconds() - t;
+
+        pthread_mutex_lock(&q->lock);
+        q->writeTime += t;
+        if (err != 0 && q->error == 0)
+            q->error = err;
+        q->used[i] = 0;
+        q->head = (i + 1) % OUTPUT_QUEUE_CHUNKS;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static size_t
+output_queue_put(outputQueue* q, const char* buf, size_t size)
+{
+    size_t done = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while (done < size && q->error == 0) {
+        int i;
+        size_t n;
+        if (q->count == OUTPUT_QUEUE_CHUNKS) {
+            double t = monotonic_seconds();
+            while (q->count == OUTPUT_QUEUE_CHUNKS)
+                pthread_cond_wait(&q->changed, &q->lock);
+            q->waitTime += monotonic_seconds() - t;
+        }
+        i = (q->head + q->count) % OUTPUT_QUEUE_CHUNKS;
+        n = q->chunkSize - q->used[i];
+        if (n > size - done)
+            n = size - done;
+        memcpy(q->chunk[i] + q->used[i], buf + done, n);
+        q->used[i] += n;
+        done += n;
+        /* pass the chunk on when it is full, or straight away if the writer
+           is idle, so the driver sees each page as soon as we have it */
+        if (q->used[i] == q->chunkSize || q->count == 0) {
+            q->count++;
+            pthread_cond_broadcast(&q->changed);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return done;
+}
+
+static int
+output_queue_close(void* cookie)
+{
+    /* write out whatever is left; the pipe or file itself is closed by dviclose */
+    outputQueue* q = (outputQueue*) cookie;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count < OUTPUT_QUEUE_CHUNKS && q->used[(q->head + q->count) % OUTPUT_QUEUE_CHUNKS] > 0)
+        q->count++;
+    q->closing = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    return 0;
+}
+
+#if defined(__GLIBC__)
+static ssize_t
+output_queue_write(void* cookie, const char* buf, size_t size)
+{
+    size_t n = output_queue_put((outputQueue*) cookie, buf, size);
+    return (n == size) ? (ssize_t) n : -1;
+}
+#else
+static int
+output_queue_write(void* cookie, const char* buf, int size)
+{
+    size_t n = output_queue_put((outputQueue*) cookie, buf, size);
+    return (n == (size_t) size) ? (int) n : -1;
+}
+#endif
+
+static FILE*
+start_output_queue(FILE* out, long megs)
+{
+    outputQueue* q;
+    FILE* f;
+    int i;
+
+    q = (outputQueue*) xcalloc(1, sizeof(outputQueue));
+    q->out = out;
+    q->chunkSize = (size_t) megs * 1024 * 1024 / OUTPUT_QUEUE_CHUNKS;
+    for (i = 0; i < OUTPUT_QUEUE_CHUNKS; ++i)
+        q->chunk[i] = (char*) xmalloc(q->chunkSize);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+
+    f = NULL;
+    if (pthread_create(&q->thread, NULL, output_queue_writer, q) == 0) {
+#if defined(__GLIBC__)
+        cookie_io_functions_t funcs = { NULL, output_queue_write, NULL, output_queue_close };
+        f = fopencookie(q, "w", funcs);
+#else
+        f = funopen(q, NULL, output_queue_write, NULL, output_queue_close);
+#endif
+        if (f == NULL)
+            output_queue_close(q);
+    }
+    if (f == NULL) {
+        /* fall back to writing directly */
+        for (i = 0; i < OUTPUT_QUEUE_CHUNKS; ++i)
+            free(q->chunk[i]);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->changed);
+        free(q);
+        return out;
+    }
+
+    setvbuf(f, NULL, _IONBF, 0); /* we do our own buffering */
+    dviQueue = q;
+    return f;
+}
+#endif
+
+static FILE*
+buffer_dvi_output(FILE* f)
+{
+    /* called before anything is written to f */
+    long megs = output_buffer_megs();
+
+    if (megs == 0)
+        return f;
+#ifdef XETEX_OUTPUT_QUEUE
+    {
+        FILE* q = start_output_queue(f, megs);
+        if (q != f)
+            return q;
+    }
+#endif
+    /* no writer thread, but at least the writes reach the pipe or file in
+       large pieces */
+    setvbuf(f, NULL, _IOFBF, (size_t) megs * 1024 * 1024);
+    return f;
+}
+
+#ifndef WIN32
+/* process id of the output driver when we started it ourselves */
+static pid_t driverPid = 0;
+
+/* characters that make the shell do more than split words at blanks */
+#define SHELL_SPECIAL_CHARS "\"'\\$`|&;<>(){}[]*?~#=%\n"
+
+static char**
+driver_argv(const char* bindir, const char* outname, const char* inname)
+{
+    /* the arguments for running outputdriver, or NULL if it isn't just words
+       separated by blanks; argv[argc + 1] holds the copy of outputdriver the
+       words point into (see free_driver_argv) */
+    char* words;
+    char* w;
+    char** argv;
+    int argc = 0;
+
+    if (strpbrk(outputdriver, SHELL_SPECIAL_CHARS) != NULL)
+        return NULL;
+    /* papersize is a single word only if the shell would also see it so */
+    if (papersize != 0 && (*papersize == '\0' || strpbrk(papersize, SHELL_SPECIAL_CHARS " \t") != NULL))
+        return NULL;
+
+    words = xstrdup(outputdriver);
+    argv = (char**) xmalloc((strlen(words) / 2 + 9) * sizeof(char*));
+    for (w = strtok(words, " \t"); w != NULL; w = strtok(NULL, " \t"))
+        argv[argc++] = w;
+    if (argc == 0) {
+        free(argv);
+        free(words);
+        return NULL;
+    }
+    if (bindir)
+        argv[0] = concat3(bindir, "/", argv[0]);
+    else
+        argv[0] = xstrdup(argv[0]);
+    argv[argc++] = (char*) "-o";
+    argv[argc++] = (char*) outname;
+    if (papersize != 0) {
+        argv[argc++] = (char*) "-p";
+        argv[argc++] = (char*) papersize;
+    }
+    if (inname != NULL)
+        argv[argc++] = (char*) inname;
+    argv[argc] = NULL;
+    argv[argc + 1] = words;
+    return argv;
+}
+
+static void
+free_driver_argv(char** argv)
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    free(argv[argc + 1]);
+    free(argv[0]);
+    free(argv);
+}
+
+static FILE*
+spawn_output_driver(const char* bindir, const char* outname)
+{
+    /* Start the driver with posix_spawn instead of popen, which saves
+       running a shell for every job. This is only done when outputdriver is
+       plain words separated by blanks; anything the shell would interpret
+       makes us return NULL, as does a failure to start the driver, and the
+       caller falls back to popen. */
+    char** argv;
+    int fds[2];
+    posix_spawn_file_actions_t actions;
+    FILE* f = NULL;
+    pid_t pid;
+    int status;
+
+    argv = driver_argv(bindir, outname, NULL);
+    if (argv == NULL)
+        return NULL;
+
+    if (pipe(fds) == 0) {
+        /* neither end may leak into \write18 children, or the driver would
+           not see the end of its input until they had finished too; the
+           driver gets the read end as its stdin, which dup2 leaves open */
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+        posix_spawn_file_actions_addclose(&actions, fds[1]);
+        if (bindir)
+            status = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+        else
+            status = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[0]);
+        if (status == 0 && (f = fdopen(fds[1], "w")) != NULL) {
+            driverPid = pid;
+        } else {
+            close(fds[1]);
+            if (status == 0)
+                waitpid(pid, &status, 0);
+        }
+    }
+
+    free_driver_argv(argv);
+    return f;
+}
+
+static int
+close_output_driver(FILE* fptr)
+{
+    int status;
+
+    if (driverPid == 0)
+        return pclose(fptr);
+
+    fclose(fptr);
+    while (waitpid(driverPid, &status, 0) == -1)
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    driverPid = 0;
+    return status;
+}
+#else
+#define close_output_driver(f) pclose(f)
+#endif
+
+static int
+open_dvi_pipe_or_file(FILE** fptr)
 {
     if (nopdfoutput) {
         return open_output(fptr, FOPEN_WBIN_MODE);
@@ -2733,25 +4446,395 @@ open_dvi_output(FILE** fptr)
             free(tmp1w);
         }
 #else
-        *fptr = popen(cmd, "w");
+        *fptr = spawn_output_driver(bindir, (const char*)nameoffile+1);
+        if (*fptr == 0)
+            *fptr = popen(cmd, "w");
 #endif
         free(cmd);
         return (*fptr != 0);
     }
 }
 
+/* Segmented XDV output (see |finish_dvi_segment| in xetex.web): the pages
+   go to \jobname.xdv, \jobname-2.xdv, ..., each a complete XDV file,
+   synced to disk before it is listed in \jobname.xdi, so a crash loses at
+   most the segment being written. Document-wide setup specials and the
+   colours pushed so far are repeated at the start of each new segment. */
+static char* segmentBase = NULL;    /* the output file name without .xdv */
+static char* segmentIndex = NULL;   /* ... and the index, with .xdi */
+static int segmentCount = 1;
+static integer segmentFirst = 0;    /* pages of the last segment, set by enddvisegments */
+static integer segmentLast = 0;
+#ifndef WIN32
+static pid_t* segmentDrivers = NULL;
+static int segmentDriverCount = 0;
+#endif
+
+typedef struct {
+    char*   text;
+    int     length;
+} segmentSpecial;
+
+static segmentSpecial* setupSpecials = NULL; /* in the order they were shipped out */
+static int setupSpecialCount = 0;
+static segmentSpecial* colorSpecials = NULL; /* color push and the like, innermost last */
+static int colorSpecialCount = 0;
+
+static long
+xdv_segment_pages(void)
+{
+    static long pages = -1;
+    if (pages < 0) {
+        char* v = kpse_var_value("xetex_xdv_segment_pages");
+        pages = (v != NULL) ? atol(v) : 0;
+        if (pages < 0)
+            pages = 0;
+        free(v);
+    }
+    return pages;
+}
+
 int
-dviclose(FILE* fptr)
+dvisegmentdue(integer pages)
 {
-    if (nopdfoutput) {
-        if (fclose(fptr) != 0)
-            return errno;
+    return segmentBase != NULL && pages >= xdv_segment_pages();
+}
+
+int
+dvisegmentcount(void)
+{
+    /* 0 if the output is not segmented */
+    return segmentBase != NULL ? segmentCount : 0;
+}
+
+char*
+dvisegmentindex(void)
+{
+    return segmentIndex;
+}
+
+static char*
+segment_name(int k, const char* ext)
+{
+    char num[16];
+    if (k == 1)
+        return concat(segmentBase, ext);
+    sprintf(num, "-%d", k);
+    return concat3(segmentBase, num, ext);
+}
+
+static void
+add_segment_special(segmentSpecial** list, int* count, const unsigned char* s, int len)
+{
+    if ((*count & (*count - 1)) == 0) /* 0, or a power of two */
+        *list = (segmentSpecial*) xrealloc(*list, (*count == 0 ? 8 : 2 * *count) * sizeof(segmentSpecial));
+    (*list)[*count].text = (char*) xmalloc(len);
+    memcpy((*list)[*count].text, s, len);
+    (*list)[*count].length = len;
+    (*count)++;
+}
+
+void
+notesegmentspecial(integer start, integer end)
+{
+    /* keep the specials in str_pool[start..end) that later segments need
+       to be converted like the first: document setup, and colours */
+    static const char* const setup[] = {
+        "papersize", "landscape", "pdf:pagesize", "pdf:docinfo", "pdf:docview",
+        "pdf:mapline", "pdf:mapfile", "x:fontmapline", "x:fontmapfile",
+        "pdf:majorversion", "pdf:minorversion", "dvipdfmx:config", NULL
+    };
+    const unsigned char* s = (const unsigned char*)&strpool[start];
+    int len = end - start;
+    int i;
+
+    if (segmentBase == NULL)
+        return;
+    while (len > 0 && (*s == ' ' || *s == '\t')) {
+        s++;
+        len--;
+    }
+    for (i = 0; setup[i] != NULL; ++i) {
+        int n = strlen(setup[i]);
+        if (len >= n && memcmp(s, setup[i], n) == 0) {
+            add_segment_special(&setupSpecials, &setupSpecialCount, s, len);
+            return;
+        }
+    }
+    if (special_starts_with(s, len, "color push") || special_starts_with(s, len, "pdf:bcolor")
+            || special_starts_with(s, len, "pdf:bc"))
+        add_segment_special(&colorSpecials, &colorSpecialCount, s, len);
+    else if (special_starts_with(s, len, "color pop") || special_starts_with(s, len, "pdf:ecolor")
+            || special_starts_with(s, len, "pdf:ec")) {
+        if (colorSpecialCount > 0)
+            free(colorSpecials[--colorSpecialCount].text);
+    }
+}
+
+static void
+dvi_out_segment_special(const segmentSpecial* sp)
+{
+    unsigned char op[5];
+    int n;
+
+    if (sp->length < 256) {
+        op[0] = 239; /* xxx1 */
+        op[1] = sp->length;
+        n = 2;
     } else {
-        return pclose(fptr);
+        op[0] = 242; /* xxx4 */
+        op[1] = (sp->length >> 24) & 0xff;
+        op[2] = (sp->length >> 16) & 0xff;
+        op[3] = (sp->length >> 8) & 0xff;
+        op[4] = sp->length & 0xff;
+        n = 5;
     }
+    dvi_out_bytes(op, n);
+    dvi_out_bytes((const unsigned char*)sp->text, sp->length);
+}
+
+void
+dvioutsegmentspecials(void)
+{
+    /* at the start of the first page of a new segment */
+    int i;
+    for (i = 0; i < setupSpecialCount; ++i)
+        dvi_out_segment_special(&setupSpecials[i]);
+    for (i = 0; i < colorSpecialCount; ++i)
+        dvi_out_segment_special(&colorSpecials[i]);
+}
+
+static int
+sync_and_close(FILE* f)
+{
+    /* the data must be on disk before the file is listed in the index */
+    if (segmentBase != NULL) {
+        int failed;
+        if (fflush(f) != 0) {
+            int err = errno;
+            fclose(f);
+            return err;
+        }
+#ifdef WIN32
+        failed = _commit(_fileno(f)) != 0;
+#else
+        /* files that can't be synced, such as pipes, give EINVAL or ENOTSUP */
+        failed = fsync(fileno(f)) != 0 && errno != EINVAL && errno != ENOTSUP;
+#endif
+        if (failed) {
+            int err = errno;
+            fclose(f);
+            return err;
+        }
+    }
+    if (fclose(f) != 0)
+        return errno;
     return 0;
 }
 
+static int
+record_segment(integer first, integer last)
+{
+    /* list the segment just closed in the index, and start the driver on
+       it if we were asked to; returns an errno value if the index could
+       not be written safely */
+    char* name = segment_name(segmentCount, ".xdv");
+    FILE* index = fopen(segmentIndex, "a");
+    int err;
+#ifndef WIN32
+    char* v;
+#endif
+
+    if (index != NULL) {
+        fprintf(index, "%s %d %d\n", name, (int) first, (int) last);
+        err = sync_and_close(index);
+    } else
+        err = errno;
+    if (err != 0) {
+        fprintf(stderr, "\n! Cannot write segment index %s: %s\n", segmentIndex, strerror(err));
+        free(name);
+        return err;
+    }
+
+#ifndef WIN32
+    v = kpse_var_value("xetex_xdv_segment_driver");
+    if (v != NULL && (*v == '1' || *v == 'y' || *v == 't')) {
+        char* pdfName = segment_name(segmentCount, ".pdf");
+        char* bindir = NULL;
+        char** argv;
+        pid_t pid;
+
+        if (!kpse_absolute_p(outputdriver, true))
+            bindir = kpse_var_value("SELFAUTOLOC");
+        argv = driver_argv(bindir, pdfName, name);
+        if (argv == NULL)
+            fprintf(stderr, "\n! Cannot run output driver `%s' on %s\n", outputdriver, name);
+        else {
+            if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) == 0) {
+                segmentDrivers = (pid_t*) xrealloc(segmentDrivers, (segmentDriverCount + 1) * sizeof(pid_t));
+                segmentDrivers[segmentDriverCount++] = pid;
+            } else
+                fprintf(stderr, "\n! Cannot run output driver `%s' on %s\n", outputdriver, name);
+            free_driver_argv(argv);
+        }
+        free(bindir);
+        free(pdfName);
+    }
+    free(v);
+#endif
+    free(name);
+    return 0;
+}
+
+int
+open_dvi_output(FILE** fptr)
+{
+    int rval = open_dvi_pipe_or_file(fptr);
+    if (rval && nopdfoutput && xdv_segment_pages() > 0) {
+        /* open_output has put the output directory into nameoffile */
+        const char* name = (const char*)nameoffile+1;
+        int len = strlen(name);
+        if (len > 4 && strcasecmp(name + len - 4, ".xdv") == 0)
+            len -= 4;
+        segmentBase = (char*) xmalloc(len + 1);
+        memcpy(segmentBase, name, len);
+        segmentBase[len] = '\0';
+        segmentIndex = concat(segmentBase, ".xdi");
+        remove(segmentIndex); /* an old index would list segments we are replacing */
+    }
+    if (rval)
+        *fptr = buffer_dvi_output(*fptr);
+    return rval;
+}
+
+#ifdef XETEX_OUTPUT_QUEUE
+/* totals over all the output files, for the report in dviclose */
+static double queueWaitTime = 0;
+static double queueWriteTime = 0;
+static int queueMegs = 0;
+#endif
+
+static int
+close_dvi_file(FILE* fptr)
+{
+#ifdef XETEX_OUTPUT_QUEUE
+    if (dviQueue != NULL) {
+        outputQueue* q = dviQueue;
+        int err, i;
+
+        fclose(fptr); /* waits for the writer to finish */
+        fptr = q->out;
+        err = q->error;
+        queueWaitTime += q->waitTime;
+        queueWriteTime += q->writeTime;
+        queueMegs = (int) (q->chunkSize * OUTPUT_QUEUE_CHUNKS / (1024 * 1024));
+        for (i = 0; i < OUTPUT_QUEUE_CHUNKS; ++i)
+            free(q->chunk[i]);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->changed);
+        free(q);
+        dviQueue = NULL;
+
+        if (nopdfoutput) {
+            int status = sync_and_close(fptr);
+            return (status != 0) ? status : err;
+        } else {
+            int status = close_output_driver(fptr);
+            return (status != 0) ? status : err;
+        }
+    }
+#endif
+    if (nopdfoutput)
+        return sync_and_close(fptr);
+    else
+        return close_output_driver(fptr);
+}
+
+void
+next_dvi_segment(FILE** fptr, integer first, integer last)
+{
+    /* close the segment that holds pages first..last and start the next */
+    char* name;
+    int err = close_dvi_file(*fptr);
+
+    if (err != 0) {
+        name = segment_name(segmentCount, ".xdv");
+        fprintf(stderr, "\n! Error writing %s: %s\n", name, strerror(err));
+        uexit(1);
+    }
+    if (record_segment(first, last) != 0)
+        uexit(1);
+
+    segmentCount++;
+    name = segment_name(segmentCount, ".xdv");
+    *fptr = xfopen(name, FOPEN_WBIN_MODE);
+    free(name);
+    *fptr = buffer_dvi_output(*fptr);
+    fontDefSection++; /* the new file must name its font files again */
+    forget_box_forms();
+}
+
+void
+enddvisegments(integer first, integer last)
+{
+    segmentFirst = first;
+    segmentLast = last;
+}
+
+int
+dviclose(FILE* fptr)
+{
+    int err = close_dvi_file(fptr);
+
+#ifdef XETEX_OUTPUT_QUEUE
+    /* the times vary from run to run, so they are only given on request */
+    if (queueMegs > 0 && logopened && gettracingstats() > 0) {
+        if (fileoffset > 0)
+            putc('\n', logfile);
+        fprintf(logfile, "Output queue of %dMB: typesetting waited %.0fms for the %s, which took %.0fms to accept the data.\n",
+                queueMegs, queueWaitTime * 1000,
+                nopdfoutput ? "output file" : "driver", queueWriteTime * 1000);
+        fileoffset = 0;
+    }
+#endif
+    if (segmentBase != NULL && err == 0) {
+        err = record_segment(segmentFirst, segmentLast);
+#ifndef WIN32
+        while (segmentDriverCount > 0) {
+            int status;
+            pid_t pid = segmentDrivers[--segmentDriverCount];
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                ;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "\n! Output driver `%s' failed on a segment of %s.xdv\n", outputdriver, segmentBase);
+        }
+#endif
+    }
+    return err;
+}
+
+char*
+get_shaping_cache_name(void)
+{
+    /* the persistent shaping cache goes beside the job's other output files */
+    char* name;
+    char* fullname;
+
+    if (jobname == 0)
+        return NULL;
+
+    name = gettexstring(jobname);
+    if (output_directory)
+        fullname = concat3(output_directory, DIR_SEP_STRING, name);
+    else
+        fullname = xstrdup(name);
+    free(name);
+
+    name = concat(fullname, ".xsc");
+    free(fullname);
+    return name;
+}
+
 int
 get_uni_c(UFILE* f)
 {
@@ -151,6 +151,8 @@ extern const uint32_t byteMark;
 extern const char *papersize;
 extern const char *outputdriver;
 
+extern unsigned char* intercharpairs;
+
 /* gFreeTypeLibrary is defined in XeTeXFontInst_FT2.cpp,
  * also used in XeTeXFontMgr_FC.cpp and XeTeX_ext.c.  */
 #include <ft2build.h>
@@ -198,6 +200,8 @@ extern "C" {
     void setinputfileencoding(unicodefile f, integer mode, integer encodingData);
     void linebreakstart(int f, integer localeStrNum, uint16_t* text, integer textLength);
     int linebreaknext(void);
+    void setnativepiecetext(int f, uint16_t* text, integer textLength);
+    void setintercharpair(integer n);
     int getencodingmodeandinfo(integer* info);
     void printutf8str(const unsigned char* str, int len);
     void printchars(const unsigned short* str, int len);
@@ -222,14 +226,32 @@ extern "C" {
     integer otfontget1(integer what, void* engine, integer param);
     integer otfontget2(integer what, void* engine, integer param1, integer param2);
     integer otfontget3(integer what, void* engine, integer param1, integer param2, integer param3);
-    int makeXDVGlyphArrayData(void* p);
+    int xdvcompact(void);
+    void dviOutNativeWord(void* p, int withText);
+    void dvioutxdvbuffer(integer len);
+    integer xdvoutputpeak(void);
+    integer xdvbuffersize(void);
+    void dvioutpool(integer start, integer end);
+    void dvioutglyph(integer width, integer glyph);
+    int reuseboxes(void);
+    void boxhashbegin(void);
+    void boxhashadd(integer v);
+    void boxhashaddreal(double r);
+    void boxHashAddNative(void* p);
+    integer boxhashform(integer nodes, integer width, integer height, integer depth);
+    void noteformspecial(integer start, integer end);
+    int makeformspecial(int kind, integer n, integer minH, integer minV, integer maxH, integer maxV);
     int makefontdef(integer f);
+    void beginxdvpostamble(void);
     int applymapping(void* cnv, uint16_t* txtPtr, int txtLen);
     void store_justified_native_glyphs(void* node);
     void measure_native_node(void* node, int use_glyph_metrics);
+    void set_native_piece_word(void* node);
+    void measure_native_piece(void* node, integer offset, int use_glyph_metrics);
     Fixed get_native_italic_correction(void* node);
     Fixed get_native_glyph_italic_correction(void* node);
     integer get_native_word_cp(void* node, int side);
+    Fixed get_native_interword_space(void* word1, void* word2);
     void measure_native_glyph(void* node, int use_glyph_metrics);
     integer mapchartoglyph(integer font, integer ch);
     integer mapglyphtoindex(integer font);
@@ -250,6 +272,16 @@ extern "C" {
     void u_close_inout(unicodefile* f);
     int open_dvi_output(FILE** fptr);
     int dviclose(FILE* fptr);
+    int dvisegmentdue(integer pages);
+    int dvisegmentcount(void);
+    char* dvisegmentindex(void);
+    void next_dvi_segment(FILE** fptr, integer first, integer last);
+    void enddvisegments(integer first, integer last);
+    void releasemappedinput(void);
+    void noteoutputfile(FILE* f);
+    void notesegmentspecial(integer start, integer end);
+    void dvioutsegmentspecials(void);
+    char* get_shaping_cache_name(void);
     int get_uni_c(UFILE* f);
     int input_line(UFILE* f);
     void makeutf16name(void);
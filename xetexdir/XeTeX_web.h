@@ -49,6 +49,7 @@ extern void zprintchar(int c);
 extern void begindiagnostic(void);
 extern void zenddiagnostic(int nl);
 extern int gettracingfontsstate(void);
+extern int gettracingstats(void);
 extern void set_cp_code(int, unsigned int, int, int);
 extern int get_cp_code(int, unsigned int, int);
 
@@ -45,6 +45,9 @@ authorization from the copyright holders.
 
 /* p is native_word node; g is XeTeX_use_glyph_metrics flag */
 #define setnativemetrics(p,g)                   measure_native_node(&(mem[p]), g)
+#define setnativepieceword(p)                   set_native_piece_word(&(mem[p]))
+/* p is a piece of that word, starting at offset o */
+#define setnativepiecemetrics(p,o,g)            measure_native_piece(&(mem[p]), o, g)
 
 #define setnativeglyphmetrics(p,g)              measure_native_glyph(&(mem[p]), g)
 
@@ -55,12 +58,18 @@ authorization from the copyright holders.
 
 #define getnativeglyph(p,i)                     get_native_glyph(&(mem[p]), i)
 
-#define makexdvglypharraydata(p)                makeXDVGlyphArrayData(&(mem[p]))
+#define dvioutnativeword(p,t)                   dviOutNativeWord(&(mem[p]),t)
+#define boxhashaddnative(p)                     boxHashAddNative(&(mem[p]))
 #define xdvbufferbyte(i)                        xdvbuffer[i]
 
 #define getcpcode       get_cp_code
 #define setcpcode       set_cp_code
 #define getnativewordcp(p,s)                    get_native_word_cp(&(mem[p]), s)
+#define getnativeinterwordspace(p,q)            get_native_interword_space(&(mem[p]), &(mem[q]))
+
+/* n is prev_class * char_class_limit + class; see setintercharpair */
+#define intercharpairmaybe(n) \
+  (intercharpairs != NULL && (intercharpairs[(n) >> 3] & (1 << ((n) & 7))))
 
 #define pic_node_size                           9
 
@@ -71,6 +80,7 @@ authorization from the copyright holders.
 #define picpathbyte(p,i)                        ((unsigned char*)&(mem[p+pic_node_size]))[i]
 
 #define dviopenout(f)                           open_dvi_output(&(f))
+#define nextdvisegment(f,a,b)                   next_dvi_segment(&(f),a,b)
 
 #define nullptr                                 (NULL)
 #define glyphinfobyte(p,k)                      ((unsigned char*)p)[k]